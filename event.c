@@ -2,7 +2,7 @@
 /*----------------------------------------------------------------------------
   File:   event.c
   Description: Rudp event handling: registering file descriptors and timeouts
-               and eventloop using the select() system call.
+               and eventloop using the select() or epoll() system call.
   Author: Olof Hagsand and Peter Sjdin
   CVS Version: $Id: event.c,v 1.3 2007/05/03 10:46:06 psj Exp $
  
@@ -42,9 +42,16 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <assert.h>
+#if defined(__linux__) && !defined(EVENT_NO_EPOLL)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "event.h"
 
+#define EVENT_MAXEVENTS 64	/* Max. number of events per epoll_wait() */
+#define EVENT_HEAP_D 4		/* Number of children per node in the timer heap */
+
 /*
  * Internal types to handle eventloop
  */
@@ -53,19 +60,244 @@ struct event_data{
     int (*e_fn)(int, void*);            /* callback function */
     enum {EVENT_FD, EVENT_TIME} e_type; /* type of event */
     int e_fd;                           /* File descriptor */
-    struct timeval e_time;              /* Timeout */
     void *e_arg;                        /* function argument */
     char e_string[32];                  /* string for identification/debugging */
+    struct event_data *e_rnext;         /* next in ready list (epoll) */
+    int e_ready;                        /* on the ready list (epoll) */
+    int e_always;                       /* cannot be polled, always ready (epoll) */
+    struct event_data *e_dnext;         /* next in deleted list */
+    int e_deleted;                      /* deregistered, not yet freed */
 };
 
+/*
+ * Timeouts are kept in a table of slots, and a 4-ary min-heap of slot
+ * numbers ordered by expiry time. A handle holds the slot number and the
+ * slot's generation, which changes when the slot is freed, so a handle
+ * for a timeout that has fired or been cancelled is recognized as stale.
+ */
+struct event_timer{
+    int (*t_fn)(int, void*);            /* callback function */
+    void *t_arg;                        /* function argument */
+    struct timeval t_time;              /* Timeout */
+    char *t_string;                     /* string for identification/debugging */
+    unsigned int t_gen;                 /* generation, part of the handle */
+    int t_index;                        /* position in heap, -1 if free */
+    int t_next;                         /* next free slot */
+};
+
+#define EVENT_HANDLE(slot, gen)	(((event_timer_t)(gen) << 32) | (unsigned int)(slot))
+#define EVENT_HANDLE_SLOT(h)	((int)((h) & 0xffffffff))
+#define EVENT_HANDLE_GEN(h)	((unsigned int)((h) >> 32))
+
+/*
+ * An event loop: the file descriptors and timeouts it dispatches. Each
+ * thread has a loop of its own, which all functions below work on, so
+ * that N threads can run N loops, e.g. one per core, without locking.
+ */
+struct event_loop{
+    struct event_data *el_fds;          /* file descriptor events */
+    struct event_timer *el_tslot;       /* timer slots */
+    int *el_heap;                       /* heap of slot numbers */
+    int el_nheap;                       /* number of pending timeouts */
+    int el_ntslot;                      /* size of el_tslot and el_heap */
+    int el_tfree;                       /* first free slot */
+    struct event_data *el_deleted;      /* fd events to free after dispatch */
+    int el_backend;                     /* EVENT_SELECT or EVENT_EPOLL */
+    struct event_data *el_ready;        /* fds that may have input (epoll) */
+    int el_epfd;                        /* epoll instance, -1 until needed */
+};
+
+#ifdef HAVE_EPOLL
+#define EVENT_DEFAULT_BACKEND	EVENT_EPOLL
+#else
+#define EVENT_DEFAULT_BACKEND	EVENT_SELECT
+#endif
+
 /*
  * Internal variables
  */
-static struct event_data *ee = NULL;
-static struct event_data *ee_timers = NULL;
+static __thread struct event_loop ee_loop = {
+    NULL, NULL, NULL, 0, 0, -1, NULL, EVENT_DEFAULT_BACKEND, NULL, -1
+};
+
+/*
+ * Select the backend used by eventloop() on the calling thread. epoll is
+ * the default where it is available. Must be called before any file
+ * descriptor is registered with the thread's loop.
+ */
+int
+event_backend(int backend)
+{
+    struct event_loop *el = &ee_loop;
+    if (el->el_fds != NULL){
+	fprintf(stderr, "event_backend: file descriptors already registered\n");
+	return -1;
+    }
+    switch (backend){
+    case EVENT_SELECT:
+	break;
+#ifdef HAVE_EPOLL
+    case EVENT_EPOLL:
+	break;
+#endif
+    default:
+	fprintf(stderr, "event_backend: backend %d not supported\n", backend);
+	return -1;
+    }
+    el->el_backend = backend;
+    return 0;
+}
+
+/* The timeout at position i in the heap of loop el */
+#define TIMER(i)	(&el->el_tslot[el->el_heap[i]])
+
+/*
+ * Put slot at position i in the timer heap.
+ */
+static void
+heap_set(int i, int slot)
+{
+    struct event_loop *el = &ee_loop;
+    el->el_heap[i] = slot;
+    el->el_tslot[slot].t_index = i;
+}
+
+/*
+ * Move the timeout at position i up the heap until its parent is earlier.
+ */
+static void
+heap_up(int i)
+{
+    struct event_loop *el = &ee_loop;
+    int slot = el->el_heap[i];
+    int parent;
+
+    while (i > 0){
+	parent = (i - 1) / EVENT_HEAP_D;
+	if (!timercmp(&el->el_tslot[slot].t_time, &TIMER(parent)->t_time, <))
+	    break;
+	heap_set(i, el->el_heap[parent]);
+	i = parent;
+    }
+    heap_set(i, slot);
+}
+
+/*
+ * Move the timeout at position i down the heap until its children are later.
+ */
+static void
+heap_down(int i)
+{
+    struct event_loop *el = &ee_loop;
+    int slot = el->el_heap[i];
+    int child, k, min;
+
+    for (;;){
+	child = EVENT_HEAP_D * i + 1;
+	if (child >= el->el_nheap)
+	    break;
+	min = child;
+	for (k = child + 1; k < child + EVENT_HEAP_D && k < el->el_nheap; k++)
+	    if (timercmp(&TIMER(k)->t_time, &TIMER(min)->t_time, <))
+		min = k;
+	if (!timercmp(&TIMER(min)->t_time, &el->el_tslot[slot].t_time, <))
+	    break;
+	heap_set(i, el->el_heap[min]);
+	i = min;
+    }
+    heap_set(i, slot);
+}
+
+/*
+ * Remove the timeout at position i from the heap and free its slot.
+ */
+static void
+heap_remove(int i)
+{
+    struct event_loop *el = &ee_loop;
+    int slot = el->el_heap[i];
+    int last;
+
+    el->el_nheap--;
+    if (i != el->el_nheap){
+	last = el->el_heap[el->el_nheap];
+	heap_set(i, last);
+	heap_down(i);
+	heap_up(el->el_tslot[last].t_index);
+    }
+    el->el_tslot[slot].t_index = -1;
+    el->el_tslot[slot].t_gen++;
+    el->el_tslot[slot].t_next = el->el_tfree;
+    el->el_tfree = slot;
+}
+
+/*
+ * Given an absolute timestamp, register function to call.
+ * Returns a handle for event_timer_cancel(), or EVENT_TIMER_NONE on error.
+ */
+event_timer_t
+event_timer(struct timeval t,  
+	    int (*fn)(int, void*), 
+	    void *arg, 
+	    char *str)
+{
+    struct event_loop *el = &ee_loop;
+    struct event_timer *et;
+    int slot, n;
+
+    if (el->el_tfree < 0){
+	/* Grow the slot table and the heap */
+	n = el->el_ntslot ? 2 * el->el_ntslot : 64;
+	et = realloc(el->el_tslot, n * sizeof(struct event_timer));
+	if (et == NULL){
+	    perror("event_timer: realloc");
+	    return EVENT_TIMER_NONE;
+	}
+	el->el_tslot = et;
+	if ((el->el_heap = realloc(el->el_heap, n * sizeof(int))) == NULL){
+	    perror("event_timer: realloc");
+	    exit(1);
+	}
+	for (slot = n - 1; slot >= el->el_ntslot; slot--){
+	    memset(&el->el_tslot[slot], 0, sizeof(struct event_timer));
+	    el->el_tslot[slot].t_gen = 1;
+	    el->el_tslot[slot].t_index = -1;
+	    el->el_tslot[slot].t_next = el->el_tfree;
+	    el->el_tfree = slot;
+	}
+	el->el_ntslot = n;
+    }
+    slot = el->el_tfree;
+    et = &el->el_tslot[slot];
+    el->el_tfree = et->t_next;
+    et->t_fn = fn;
+    et->t_arg = arg;
+    et->t_time = t;
+    et->t_string = str;
+    heap_set(el->el_nheap, slot);
+    heap_up(el->el_nheap++);
+    return EVENT_HANDLE(slot, et->t_gen);
+}
+
+/*
+ * Cancel a timeout registered with event_timer().
+ * Returns -1 if it has already fired or been cancelled.
+ */
+int
+event_timer_cancel(event_timer_t handle)
+{
+    struct event_loop *el = &ee_loop;
+    int slot = EVENT_HANDLE_SLOT(handle);
+
+    if (handle == EVENT_TIMER_NONE || slot >= el->el_ntslot)
+	return -1;
+    if (el->el_tslot[slot].t_gen != EVENT_HANDLE_GEN(handle) || el->el_tslot[slot].t_index < 0)
+	return -1;
+    heap_remove(el->el_tslot[slot].t_index);
+    return 0;
+}
 
 /*
- * Sort into internal event list
  * Given an absolute timestamp, register function to call.
  */
 int
@@ -74,46 +306,51 @@ event_timeout(struct timeval t,
 		   void *arg, 
 		   char *str)
 {
-    struct event_data *e, *e1, **e_prev;
+    return event_timer(t, fn, arg, str) == EVENT_TIMER_NONE ? -1 : 0;
+}
 
-    e = (struct event_data *)malloc(sizeof(struct event_data));
-    if (e == NULL){
-	perror("event_timeout: malloc");
-	return -1;
-    }
-    memset(e, 0, sizeof(struct event_data));
-    strcpy(e->e_string, str);
-    e->e_fn = fn;
-    e->e_arg = arg;
-    e->e_type = EVENT_TIME;
-    e->e_time = t;
+/*
+ * Deregister a rudp event. This has to search all pending timeouts;
+ * event_timer_cancel() does not.
+ */
+int
+event_timeout_delete(int (*fn)(int, void*), 
+		  void *arg)
+{
+    struct event_loop *el = &ee_loop;
+    int i;
 
-    /* Sort into right place */
-    e_prev = &ee_timers;
-    for (e1 = ee_timers; e1; e1 =e1->e_next){
-	if (timercmp(&e->e_time, &e1->e_time, <))
-	    break;
-	e_prev = &e1->e_next;
-    }
-    e->e_next = e1;
-    *e_prev = e;
-    return 0;
+    for (i = 0; i < el->el_nheap; i++)
+	if (fn == TIMER(i)->t_fn && arg == TIMER(i)->t_arg) {
+	    heap_remove(i);
+	    return 0;
+	}
+    /* Not found */
+    return -1;
 }
 
 /*
- * Deregister a rudp event.
+ * Deregister a file descriptor event. It is freed once the event loop
+ * is done dispatching, since the loop may still refer to it.
  */
-static int
-event_delete(struct event_data **firstp, int (*fn)(int, void*), 
+int
+event_fd_delete(int (*fn)(int, void*), 
 		  void *arg)
 {
+    struct event_loop *el = &ee_loop;
     struct event_data *e, **e_prev;
 
-    e_prev = firstp;
-    for (e = *firstp; e; e = e->e_next){
+    e_prev = &el->el_fds;
+    for (e = el->el_fds; e; e = e->e_next){
 	if (fn == e->e_fn && arg == e->e_arg) {
 	    *e_prev = e->e_next;
-	    free(e);
+#ifdef HAVE_EPOLL
+	    if (el->el_backend == EVENT_EPOLL && !e->e_always)
+		epoll_ctl(el->el_epfd, EPOLL_CTL_DEL, e->e_fd, NULL);
+#endif
+	    e->e_deleted = 1;
+	    e->e_dnext = el->el_deleted;
+	    el->el_deleted = e;
 	    return 0;
 	}
 	e_prev = &e->e_next;
@@ -123,24 +360,52 @@ event_delete(struct event_data **firstp, int (*fn)(int, void*),
 }
 
 /*
- * Deregister a rudp event.
+ * Free the file descriptor events deregistered during dispatch.
  */
-int
-event_timeout_delete(int (*fn)(int, void*), 
-		  void *arg)
+static void
+event_free_deleted()
 {
-    return event_delete(&ee_timers, fn, arg);
+    struct event_loop *el = &ee_loop;
+    struct event_data *e;
+
+    while ((e = el->el_deleted) != NULL){
+	el->el_deleted = e->e_dnext;
+	free(e);
+    }
 }
 
+#ifdef HAVE_EPOLL
 /*
- * Deregister a file descriptor event.
+ * Add a file descriptor event to the epoll set, edge-triggered.
+ * Files that epoll refuses (regular files) are always ready, which is
+ * what select() reports for them.
  */
-int
-event_fd_delete(int (*fn)(int, void*), 
-		  void *arg)
+static int
+event_epoll_add(struct event_data *e)
 {
-    return event_delete(&ee, fn, arg);
+    struct event_loop *el = &ee_loop;
+    struct epoll_event ev;
+
+    if (el->el_epfd < 0 && (el->el_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+	perror("event_fd: epoll_create1");
+	return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = e;
+    if (epoll_ctl(el->el_epfd, EPOLL_CTL_ADD, e->e_fd, &ev) < 0){
+	if (errno != EPERM){
+	    perror("event_fd: epoll_ctl");
+	    return -1;
+	}
+	e->e_always = 1;
+	e->e_ready = 1;
+	e->e_rnext = el->el_ready;
+	el->el_ready = e;
+    }
+    return 0;
 }
+#endif /* HAVE_EPOLL */
 
 /*
  * Register a callback function when something occurs on a file descriptor.
@@ -151,8 +416,13 @@ event_fd_delete(int (*fn)(int, void*),
 int
 event_fd(int fd, int (*fn)(int, void*), void *arg, char *str)
 {
+    struct event_loop *el = &ee_loop;
     struct event_data *e;
 
+    if (el->el_backend == EVENT_SELECT && fd >= FD_SETSIZE){
+	fprintf(stderr, "event_fd: fd %d is too large for select\n", fd);
+	return -1;
+    }
     e = (struct event_data *)malloc(sizeof(struct event_data));
     if (e==NULL){
 	perror("event_fd: malloc");
@@ -164,68 +434,91 @@ event_fd(int fd, int (*fn)(int, void*), void *arg, char *str)
     e->e_fn = fn;
     e->e_arg = arg;
     e->e_type = EVENT_FD;
-    e->e_next = ee;
-    ee = e;
+#ifdef HAVE_EPOLL
+    if (el->el_backend == EVENT_EPOLL && event_epoll_add(e) < 0){
+	free(e);
+	return -1;
+    }
+#endif
+    e->e_next = el->el_fds;
+    el->el_fds = e;
     return 0;
 }
 
 
 /*
- * Rudp event loop.
- * Dispatch file descriptor events (and timeouts) by invoking callbacks.
+ * Call all timeouts that have expired.
  */
-int
-eventloop()
+static int
+event_timers_run()
+{
+    struct event_loop *el = &ee_loop;
+    struct event_timer *et;
+    int (*fn)(int, void*);
+    void *arg;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    while (el->el_nheap > 0 && !timercmp(&now, &TIMER(0)->t_time, <)){
+	et = TIMER(0);
+	fn = et->t_fn;
+	arg = et->t_arg;
+#ifdef DEBUG
+	fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n", 
+		et->t_string, (int)arg);
+#endif /* DEBUG */
+	heap_remove(0);
+	if ((*fn)(0, arg) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Event loop using select(). The fd_set is rebuilt from the list of
+ * file descriptor events on every iteration.
+ */
+static int
+eventloop_select()
 {
+    struct event_loop *el = &ee_loop;
     struct event_data *e, *e1;
     fd_set fdset;
     int n;
     struct timeval t, t0;
 
-    while (ee || ee_timers){
+    while (el->el_fds || el->el_nheap){
+	if (event_timers_run() < 0)
+	    return -1;
+	if (el->el_fds == NULL && el->el_nheap == 0)
+	    break;
+
 	FD_ZERO(&fdset);
-	for (e=ee; e; e=e->e_next)
+	for (e=el->el_fds; e; e=e->e_next)
 	    if (e->e_type == EVENT_FD)
 		FD_SET(e->e_fd, &fdset);
 
-	if (ee_timers){
+	if (el->el_nheap){
 	    gettimeofday(&t0, NULL);
-	    timersub(&ee_timers->e_time, &t0, &t); 
+	    timersub(&TIMER(0)->t_time, &t0, &t); 
 	    if (t.tv_sec < 0)
-		n = 0;
-	    else
-		n = select(FD_SETSIZE, &fdset, NULL, NULL, &t); 
+		timerclear(&t);
+	    n = select(FD_SETSIZE, &fdset, NULL, NULL, &t); 
 	}
 	else
 	    n = select(FD_SETSIZE, &fdset, NULL, NULL, NULL); 
 
-	if (n == -1)
+	if (n == -1){
 	    if (errno != EINTR)
 		perror("eventloop: select");
-	if (n == 0) {  /* Timeout */
-	    e = ee_timers;
-	    ee_timers = ee_timers->e_next;
-#ifdef DEBUG
-	    fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n", 
-		    e->e_string, (int)e->e_arg);
-#endif /* DEBUG */
-	    if ((*e->e_fn)(0, e->e_arg) < 0) {
-		return -1;
-
-	    }
-	    switch(e->e_type) {
-	    case EVENT_TIME:
-		free(e);
-		break;
-	    default:
-		fprintf(stderr, "eventloop: illegal e_type:%d\n", e->e_type);
-	    }
 	    continue;
 	}
-	e = ee;
+	if (n == 0)  /* Timeout */
+	    continue;
+	e = el->el_fds;
 	while (e) {
 		e1 = e->e_next;
-	    if (e->e_type == EVENT_FD && FD_ISSET(e->e_fd, &fdset)){
+	    if (e->e_type == EVENT_FD && !e->e_deleted && FD_ISSET(e->e_fd, &fdset)){
 #ifdef DEBUG
 		fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n", 
 			e->e_string, e->e_fd, (int)e->e_arg);
@@ -236,9 +529,153 @@ eventloop()
 	    }
 	    e = e1;
 	}
+	event_free_deleted();
     }
+    return 0;
+}
+
+#ifdef HAVE_EPOLL
+/*
+ * Check whether a file descriptor still has input.
+ */
+static int
+event_readable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLIN|POLLERR|POLLHUP));
+}
+
+/*
+ * Event loop using epoll(). File descriptors are registered once and are
+ * edge-triggered, so epoll_wait() only reports new input. A reported fd
+ * goes on the ready list and its callback is called once per iteration
+ * until the fd has been drained, so that timeouts and other fds are
+ * served in between.
+ */
+static int
+eventloop_epoll()
+{
+    struct event_loop *el = &ee_loop;
+    struct epoll_event events[EVENT_MAXEVENTS];
+    struct event_data *e, *e1, *ready;
+    int i, n, timeout;
+    struct timeval t, t0;
+
+    while (el->el_fds || el->el_nheap){
+	if (event_timers_run() < 0)
+	    return -1;
+	if (el->el_fds == NULL && el->el_nheap == 0)
+	    break;
+
+	if (el->el_nheap){
+	    gettimeofday(&t0, NULL);
+	    timersub(&TIMER(0)->t_time, &t0, &t); 
+	    if (t.tv_sec < 0)
+		timeout = 0;
+	    else
+		/* Round up, so that the timer has expired when we wake up */
+		timeout = t.tv_sec * 1000 + (t.tv_usec + 999) / 1000;
+	}
+	else
+	    timeout = -1;
+	if (el->el_ready)
+	    timeout = 0;
+
+	if (el->el_epfd < 0)
+	    n = poll(NULL, 0, timeout);
+	else
+	    n = epoll_wait(el->el_epfd, events, EVENT_MAXEVENTS, timeout);
+	if (n == -1){
+	    if (errno != EINTR)
+		perror("eventloop: epoll_wait");
+	    continue;
+	}
+	for (i = 0; i < n; i++){
+	    e = events[i].data.ptr;
+	    if (!e->e_ready){
+		e->e_ready = 1;
+		e->e_rnext = el->el_ready;
+		el->el_ready = e;
+	    }
+	}
+
+	ready = el->el_ready;
+	el->el_ready = NULL;
+	for (e = ready; e; e = e1){
+	    e1 = e->e_rnext;
+	    e->e_ready = 0;
+	    if (e->e_deleted)
+		continue;
 #ifdef DEBUG
-    fprintf(stderr, "eventloop: returning 0\n");
+	    fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n", 
+		    e->e_string, e->e_fd, (int)e->e_arg);
 #endif /* DEBUG */
+	    if ((*e->e_fn)(e->e_fd, e->e_arg) < 0) {
+		return  -1;
+	    }
+	    /* Keep it ready until it has been drained */
+	    if (!e->e_deleted && !e->e_ready && (e->e_always || event_readable(e->e_fd))){
+		e->e_ready = 1;
+		e->e_rnext = el->el_ready;
+		el->el_ready = e;
+	    }
+	}
+	event_free_deleted();
+    }
     return 0;
 }
+#endif /* HAVE_EPOLL */
+
+/*
+ * Free the tables of the calling thread's event loop, e.g. before the
+ * thread exits. Fails if events are still registered. Timer handles of
+ * the loop must not be used afterwards.
+ */
+int
+event_loop_free()
+{
+    struct event_loop *el = &ee_loop;
+
+    if (el->el_fds != NULL || el->el_nheap > 0){
+	fprintf(stderr, "event_loop_free: events still registered\n");
+	return -1;
+    }
+    event_free_deleted();
+    free(el->el_tslot);
+    free(el->el_heap);
+    el->el_tslot = NULL;
+    el->el_heap = NULL;
+    el->el_ntslot = 0;
+    el->el_tfree = -1;
+#ifdef HAVE_EPOLL
+    if (el->el_epfd >= 0)
+	close(el->el_epfd);
+    el->el_epfd = -1;
+#endif
+    return 0;
+}
+
+/*
+ * Rudp event loop.
+ * Dispatch file descriptor events (and timeouts) by invoking callbacks.
+ */
+int
+eventloop()
+{
+    int retval;
+
+#ifdef HAVE_EPOLL
+    if (ee_loop.el_backend == EVENT_EPOLL)
+	retval = eventloop_epoll();
+    else
+#endif
+	retval = eventloop_select();
+#ifdef DEBUG
+    fprintf(stderr, "eventloop: returning %d\n", retval);
+#endif /* DEBUG */
+    return retval;
+}
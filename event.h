@@ -29,14 +29,43 @@
  * arg is an argument given when the callback was registered.
  * If the return value of the callback is < 0, it is treated as an unrecoverable
  * error, and the program is terminated.
+ *
+ * Every thread has an event loop of its own. The functions below register
+ * events with, and eventloop() runs, the loop of the calling thread, so
+ * a callback is always called on the thread that registered it.
+ *
+ * By design there is no handle to a loop: it is thread-local state, not
+ * an object that is passed around, so that the original single-threaded
+ * interface still works and a loop needs no locks. A loop can only be
+ * driven and inspected by its own thread. Another thread that has work
+ * for it makes a descriptor readable that the loop has registered, as
+ * rudp_submit_sendto does with an eventfd.
  */
 
 
+/*
+ * Event loop backends. EVENT_EPOLL is only available on Linux, where it
+ * is the default; compile with -DEVENT_NO_EPOLL to leave it out.
+ */
+#define EVENT_SELECT	0
+#define EVENT_EPOLL	1
+
+/*
+ * Handle for a timeout, used to cancel it
+ */
+typedef unsigned long long event_timer_t;
+
+#define EVENT_TIMER_NONE	0	/* Never a valid handle */
+
 /*
  * Prototypes
  */
+int event_backend(int backend);
 int event_timeout(struct timeval timer,  
 		       int (*callback)(int, void*), void *callback_arg, char *idstr);
+event_timer_t event_timer(struct timeval timer,  
+		       int (*callback)(int, void*), void *callback_arg, char *idstr);
+int event_timer_cancel(event_timer_t handle);
 
 int
 event_periodic(int secs,  
@@ -48,5 +77,6 @@ int event_timeout_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd_delete(int (*callback)(int, void*), void *callback_arg);
 int event_fd(int fd, int (*callback)(int, void*), void *callback_arg, char *idstr);
 int eventloop();
+int event_loop_free();
 
 #endif /* EVENT_H */
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Objects and slab headers are aligned to this many bytes
+#define POOL_ALIGN	16
+#define POOL_ROUND(n)	(((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+/*
+ * pool_init: Create an empty pool of objects of size bytes.
+ */
+void pool_init(struct pool *pool, size_t size) {
+	if(size < sizeof(void *))
+		size = sizeof(void *);
+	pool->size = POOL_ROUND(size);
+	pool->free_list = NULL;
+	pool->slabs = NULL;
+	pool->allocated = 0;
+	pool->in_use = 0;
+}
+
+/*
+ * pool_get: Take an object from the pool, adding a slab if it is empty.
+ * Returns NULL if no memory could be allocated.
+ */
+void *pool_get(struct pool *pool) {
+	if(pool->free_list == NULL) {
+		int i;
+		char *objects;
+		struct pool_slab *slab = malloc(POOL_ROUND(sizeof(struct pool_slab)) + POOL_SLAB * pool->size);
+		if(slab == NULL) {
+			perror("pool_get: malloc");
+			return NULL;
+		}
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		objects = (char *)slab + POOL_ROUND(sizeof(struct pool_slab));
+		for(i = POOL_SLAB - 1; i >= 0; i--) {
+			*(void **)(objects + i * pool->size) = pool->free_list;
+			pool->free_list = objects + i * pool->size;
+		}
+		pool->allocated += POOL_SLAB;
+	}
+
+	void *object = pool->free_list;
+	pool->free_list = *(void **)object;
+	pool->in_use++;
+	return object;
+}
+
+/*
+ * pool_put: Return an object taken from the pool.
+ */
+void pool_put(struct pool *pool, void *object) {
+	if(object == NULL)
+		return;
+	*(void **)object = pool->free_list;
+	pool->free_list = object;
+	pool->in_use--;
+}
+
+/*
+ * pool_destroy: Free all slabs. Objects still in use become invalid.
+ */
+void pool_destroy(struct pool *pool) {
+	while(pool->slabs != NULL) {
+		struct pool_slab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pool->free_list = NULL;
+	pool->allocated = 0;
+	pool->in_use = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef POOL_H
+#define	POOL_H
+
+/*
+ * Fixed-size object pools. Objects are carved out of slabs of POOL_SLAB
+ * objects and recycled through a free list, so once a pool has grown to
+ * its working size, getting and putting objects does not touch the heap.
+ * Slabs are returned to the system when the pool is destroyed.
+ */
+
+#define POOL_SLAB	64	/* Objects per slab */
+
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+struct pool {
+	size_t size;		/* Object size, rounded up for alignment */
+	void *free_list;	/* Free objects, linked through their first word */
+	struct pool_slab *slabs;	/* All slabs of the pool */
+	int allocated;		/* Objects in the slabs */
+	int in_use;		/* Objects handed out */
+};
+
+/*
+ * Prototypes
+ */
+
+void pool_init(struct pool *pool, size_t size);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *object);
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H */
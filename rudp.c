@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE	// recvmmsg and sendmmsg
+#endif
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,62 +12,258 @@
 #include <sys/time.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "event.h"
 #include "rudp.h"
 #include "rudp_api.h"
-
-// Probability of packet loss
-#define DROP 0
+#include "rudp_cc.h"
+#include "pool.h"
+#include "rudp_log.h"
+
+#ifdef __linux__
+#define HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+#if defined(__linux__) && !defined(RUDP_NO_MMSG)
+#define HAVE_MMSG
+#endif
 
 // RUDP states
 enum {SYN_SENT, OPENING, OPEN, FIN_SENT};
 
-// Pointer to the head of the sockets list
-struct sockets *sockets_list_head = NULL;
+/*
+ * Sockets, indexed by the low SOCKET_INDEX_BITS of their handles. The
+ * other bits of a handle are the generation of its slot, which changes
+ * when the socket is freed, so a stale handle does not match a socket
+ * that reuses the slot. The table is made of chunks of SOCKET_CHUNK
+ * slots that are never moved, so that sockets can be found without a
+ * lock while other threads add theirs. A thread that submits a request
+ * counts itself in the slot while it uses the socket, and free_socket
+ * waits for the count to drop to zero before it frees the socket.
+ */
+#define SOCKET_INDEX_BITS	16
+#define SOCKET_INDEX_MASK	((1 << SOCKET_INDEX_BITS) - 1)
+#define SOCKET_CHUNK_BITS	8
+#define SOCKET_CHUNK	(1 << SOCKET_CHUNK_BITS)
+#define SOCKET_SLOT(i)	(&socket_table[(i) >> SOCKET_CHUNK_BITS][(i) & (SOCKET_CHUNK - 1)])
+
+/*
+ * Buffers for the datagrams of a socket that are read, and sent in reply,
+ * in one batch. A datagram is read into the header in rx_hdr and the
+ * payload of a packet from the socket's pool, so that the packet can be
+ * kept for reordering or loaned to the application without copying it.
+ */
+struct io_batch {
+	struct rudp_wirehdr rx_hdr[RUDP_RECV_BATCH];
+	struct rudp_packet *rx[RUDP_RECV_BATCH]; // NULL if the packet has been kept
+	int rx_len[RUDP_RECV_BATCH];
+	struct sockaddr_in rx_from[RUDP_RECV_BATCH];
+	char tx[RUDP_SEND_BATCH][RUDP_HDRLEN + RUDP_SACK_BYTES(RUDP_MAXWINDOW)]; // Headers, and the payloads of ACKs
+	struct iovec tx_iov[RUDP_SEND_BATCH][RUDP_MAXIOV + 1]; // Header in tx, then the payload where it is
+	int tx_iovcnt[RUDP_SEND_BATCH];
+	struct sockaddr_in tx_to[RUDP_SEND_BATCH];
+	int tx_count; // Packets held back
+	int deferring; // Hold packets back until the batch has been handled?
+	struct rudp_packet *sent_head; // Packets that are done with, but may still be in tx_iov
+	struct rudp_packet *sent_tail;
+};
+
+struct socket_slot {
+	struct sockets *socket; // NULL if the slot is free
+	uintptr_t generation; // Generation of the next socket in the slot
+	int submitters; // Threads in rudp_submit_sendto or rudp_submit_close on the socket
+};
+
+struct socket_slot *socket_table[(SOCKET_INDEX_MASK + 1) / SOCKET_CHUNK];
+int socket_table_size = 0; // Slots in the chunks that have been allocated
+pthread_mutex_t socket_lock = PTHREAD_MUTEX_INITIALIZER; // Held to add or free a socket
+
+// Marks a slot of a session table whose session has been removed
+struct session session_removed;
+#define SESSION_REMOVED	(&session_removed)
+
+/*
+ * A retransmission that was sent to the multicast group, so that the
+ * members that lost the packet too do not ask for it again
+ */
+struct group_repair {
+	u_int32_t seqno;
+	struct timeval time; // When it was sent, zero if never
+};
 
 struct sockets {
-	rudp_socket_t rsock;
+	rudp_socket_t rsock; // Handle of the socket
+	int fd; // UDP socket
 	int closeRequested;
+	int window; // Window size for new sessions (RUDP_OPT_WINDOW)
+	int rto_min; // Retransmission timeout bounds in milliseconds (RUDP_OPT_RTO_MIN/MAX)
+	int rto_max;
+	int cc; // Congestion control algorithm for new sessions (RUDP_OPT_CC)
+	int ack_every; // ACK every so many DATA packets (RUDP_OPT_ACK_EVERY)
+	int ack_delay; // Max. delay of an ACK in milliseconds (RUDP_OPT_ACK_DELAY)
+	int recv_loan; // Does the application keep received data until rudp_release? (RUDP_OPT_RECV_LOAN)
+	int mss; // Largest payload sent or received, the size of the packets in the pool (RUDP_OPT_MSS)
+	int stream_delay; // Max. time data of rudp_write is held back, in milliseconds (RUDP_OPT_STREAM_DELAY)
+	int sndbuf; // Max. number of packets queued per session, 0 for no limit (RUDP_OPT_SNDBUF)
+	int pmtud; // Probe the path MTU of new sessions? (RUDP_OPT_PMTUD)
+	int loss; // Percentage of the packets sent that are dropped, for testing (RUDP_OPT_LOSS)
 	int (*recv_handler)(rudp_socket_t, struct sockaddr_in *, char *, int);
 	int (*handler)(rudp_socket_t, rudp_event_t, struct sockaddr_in *);
+	int (*sent_handler)(rudp_socket_t, void *, int);
 	struct session *sessions_list_head;
-	struct sockets *next;
+	struct session **session_table; // Sessions by peer address, open addressing with linear probing
+	u_int32_t session_mask; // Size of session_table minus one
+	int sessions; // Number of sessions
+	int session_slots_used; // Slots of session_table in use, or freed by a removal
+	struct session *finished_head; // Finished sessions, oldest first, until they are evicted
+	struct session *finished_tail;
+	int finished; // Number of finished sessions
+	struct pool packets; // Packets queued, in flight or held for reordering
+	struct pool refs; // Packets without room for a payload, which is in buffers elsewhere
+	struct pool shared; // Payloads of rudp_sendto_group, with room for the MSS
+	struct io_batch *io; // Datagram buffers
+	struct rudp_request *submit_head; // Requests of other threads, newest first; pushed by any thread
+	int submit_signalled; // Has the loop been woken since it last took the requests?
+	int submitted[RUDP_SUBMIT_BUCKETS]; // Sends that have not been carried out, by hash of the peer
+	int submit_closed; // Has rudp_submit_close been called? Later requests fail
+	int submit_fd[2]; // Read and write end of the wakeup: one eventfd, or a pipe
+	struct rudp_request *backlog; // Requests taken that wait for a send buffer, oldest first
+	struct rudp_request *backlog_tail;
+	struct sockaddr_in group; // Multicast group DATA of rudp_sendto_group goes to, sin_family 0 if none (rudp_multicast)
+	int members; // Sender sessions in the group
+	int group_opening; // Are members being opened? They number their packets from group_seq
+	int group_sending; // Is rudp_sendto_group queueing packets for the members?
+	u_int32_t group_seq; // Seqno of the last packet sent to the group
+	struct group_repair repairs[RUDP_GROUP_REPAIRS]; // Last repairs sent to the group, by seqno
+	int group_fd; // Socket that receives the DATA of a group joined with rudp_join_group, or -1
 };
 
-struct data {
-	void *item;
+/*
+ * A rudp_submit_sendto or rudp_submit_close call from another thread,
+ * carried out by the loop of the socket
+ */
+struct rudp_request {
+	struct rudp_request *next;
+	int close; // rudp_close rather than rudp_sendto?
+	struct sockaddr_in to;
 	int len;
-	struct data *next;
+	char data[];
 };
 
 struct rudp_packet {
 	struct rudp_hdr header;
 	int payload_length;
-	char payload[RUDP_MAXPKTSIZE];
+	char *payload; // Right after the packet if it is from a pool, which has room for the MSS
+	struct iovec iov[RUDP_MAXIOV]; // Caller's buffers that hold the payload instead (rudp_sendv)
+	int iovcnt; // Number of them, 0 if the payload is in payload
+	void *cookie; // Passed to the sent handler once the buffers may be reused
+	struct rudp_shared *shared; // Buffer in iov shared with the packets to other peers (rudp_sendto_group)
+	int delivered; // Was the packet acknowledged?
+	struct rudp_packet *next; // Next packet in the data queue
+};
+
+/*
+ * The payload of rudp_sendto_group, copied once and referred to by the
+ * packet of every peer. It is taken from a pool of the socket and put
+ * back when the last of them has been released. All of them belong to
+ * one socket, and so to one thread.
+ */
+struct rudp_shared {
+	int refs;
+	char data[];
+};
+
+// Type of a message reassembled from several packets, which is malloced
+// like a packet with its payload after it
+#define RUDP_MESSAGE	0
+
+struct timeoutargs{
+	struct sockets *socket;
+	struct rudp_hdr header; // Header of the packet the timer is for
+	struct rudp_packet *packet; // The packet, if it is DATA
+	struct sockaddr_in *recipient;
+};
+
+struct window_slot {
+	struct rudp_packet *packet; // Transmitted but unacknowledged packet
+	int retransmission_attempts; // Retransmissions of this packet
+	int acked; // Has it been selectively ACKed?
+	event_timer_t timer; // Its retransmission timer
+	struct timeoutargs timeargs; // Argument of its timer
+	struct timeval sent_time; // When it was last sent
+	long rto; // Retransmission timeout its timer was set with, in microseconds
 };
 
 struct sender_session {
 	int status;
 	u_int32_t seqNo;//Seq Number used for sending
-	struct rudp_packet *sliding_window[RUDP_WINDOW]; // Sliding window
-	int retransmission_attempts[RUDP_WINDOW]; // Retransmissions for each packet in the window
-	struct data *data_queue; // Queue of unsent data
+	u_int32_t window_base; // Seq number of the oldest unacknowledged packet
+	int in_flight; // Number of packets in the window, starting at window_base
+	int window_size; // Max. number of unacknowledged packets
+	u_int32_t window_mask; // Size of the window ring minus one
+	struct window_slot *window; // Sliding window, a ring indexed by seqno & window_mask
+	struct rudp_packet *data_queue; // Queue of unsent data
+	struct rudp_packet *data_tail; // Last packet in it
+	int queued; // Number of packets in it
+	int blocked; // Has a send failed with EAGAIN since RUDP_EVENT_WRITABLE?
+	int member; // Is the peer in the multicast group of the socket? Its packets are sent to the group
+	struct sockets *socket; // Socket whose pool holds the packets in the queue and window
+	struct sockaddr_in *peer;
+	int mss; // Largest payload sent, larger packets are split
+	int mss_max; // Largest payload the peer accepts, lowered when a PMTU probe fails
+	int probes; // PMTU probes that have been answered or given up on
+	int probe_size; // Payload of the PMTU probe in flight, 0 if none
+	int probe_tries; // Times it has been sent
+	u_int32_t probe_seq; // Its seqno
+	event_timer_t probe_timer; // Its timeout
+	struct rudp_packet *stream; // Packet being filled by rudp_write, not queued yet, or NULL
+	event_timer_t stream_timer; // When it is queued even if it is not full
 	int sessionFinished; // Has the FIN we sent been ACKed?
-	void * syn_timeout_arg; // Argument pointer used to delete SYN timeout event
-	void * fin_timeout_arg; // Argument pointer used to delete FIN timeout event
-	void * data_timeout_arg[RUDP_WINDOW]; // Argument pointers used to DATA delete timeout events
+	event_timer_t syn_timer; // SYN retransmission timer
+	event_timer_t fin_timer; // FIN retransmission timer
+	struct timeoutargs syn_timeargs; // Arguments of these timers
+	struct timeoutargs fin_timeargs;
 	int syn_retransmit_attempts;
 	int fin_retransmit_attempts;
+	struct timeval syn_sent_time; // When the SYN was last sent
+	long srtt; // Smoothed round-trip time in microseconds, 0 until measured
+	long rttvar; // Round-trip time variation in microseconds
+	long rto; // Retransmission timeout in microseconds
+	long rto_min; // Bounds for rto
+	long rto_max;
+	struct rudp_cc cc; // Congestion control state
+	int dupacks; // ACKs in a row that did not move window_base
+	u_int32_t recover; // Highest seq number sent when the current loss recovery started
 };
 
 struct receiver_session {
 	int status;
 	u_int32_t expected_seqNo;//Expected seq number used for receiving
 	int sessionFinished; // Have we received a FIN from the sender?
+	int window_size; // Max. number of packets we accept ahead of expected_seqNo
+	u_int32_t window_mask; // Size of the reorder buffer ring minus one
+	struct rudp_packet **reorder_buffer; // Out-of-order DATA, a ring indexed by seqno & window_mask
+	int buffered; // Number of packets in the reorder buffer
+	u_int32_t highest_seqNo; // Highest seq number in the reorder buffer
+	struct pool *packets; // Pool of the socket, for the reorder buffer
+	struct rudp_packet *message; // Message being reassembled, or NULL
+	int message_size; // Bytes allocated for its payload
+	int ack_every; // ACK every so many packets received in order (RUDP_OPT_ACK_EVERY)
+	long ack_delay; // Max. time an ACK is held back, in microseconds
+	int unacked; // Packets received in order since the last ACK
+	int quickacks; // Packets still to be ACKed at once after a loss
+	event_timer_t ack_timer; // Sends an ACK that has been held back
+	struct sockets *socket; // Where the ACKs are sent from and to
+	struct sockaddr_in *peer;
 };
 
 struct session {
@@ -72,33 +271,105 @@ struct session {
 	struct receiver_session *receiver;
 	struct sockaddr_in *address; // Peer address
 	struct session* next; // Next pointer in linked list
+	struct session* prev;
+	struct session* finished_next; // Next in the socket's queue of finished sessions
+	int finished_queued; // Is it in that queue?
+	struct timeval finished_time; // When it was queued
 };
 
 
-struct timeoutargs{
-	rudp_socket_t fd;
-	struct rudp_packet *packet;
-	struct sockaddr_in *recipient;
-};
-
 // Prototypes
 int receiveCallback(int file, void *arg);
+int receive_packet(struct sockets *socket, struct rudp_wirehdr *wh, struct rudp_packet **pp, int len, struct sockaddr_in *from);
+int deliver_packet(struct sockets *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p);
+int reassemble(struct sockets *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p);
+void queue_send(struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient);
+void flush_sends(struct sockets *socket);
+int packet_iov(struct rudp_packet *p, struct rudp_wirehdr *wh, struct iovec *iov);
+void release_packet(struct sockets *socket, struct rudp_packet *p, int delivered);
+void complete_packets(struct sockets *socket);
+int queue_data(struct sockets *socket, struct rudp_packet *data_item, struct sockaddr_in *to);
+struct session *open_sender(struct sockets *socket, struct sockaddr_in *to);
+void append_data(struct sockets *socket, struct session *session, struct rudp_packet *data_item);
+void flush_stream(struct sockets *socket, struct session *session);
+int send_blocked(struct sockets *socket, struct sockaddr_in *to);
+void check_writable(struct sockets *socket, struct session *session);
+int submit_request(struct sockets *socket, struct rudp_request *request);
+int submitCallback(int fd, void *arg);
+void run_requests(struct sockets *socket);
+int streamTimeoutCallback(int fd, void *arg);
 int timeoutCallback(int currentRetryAttempts, void *args);
-int send_packet(int isAck, rudp_socket_t rsocket, struct rudp_packet *p, struct sockaddr_in *recipient,int retransmission);
-
-// Whether or not the random number generator has been seeded
-int rng_seeded = 0;
+int send_packet(int isAck, struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient,int retransmission);
+void start_timer(struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient);
+void resend_data(struct sockets *socket, struct session *session, struct window_slot *slot);
+void send_group(struct sockets *socket);
+int open_group(struct sockets *socket, int len, struct sockaddr_in *to, int npeers);
+int groupCallback(int fd, void *arg);
+struct rudp_packet *packet_get(struct sockets *socket);
+struct rudp_packet *packet_ref(struct sockets *socket);
+void packet_put(struct sockets *socket, struct rudp_packet *p);
+void packet_read(struct rudp_packet *p, int offset, char *buf, int len);
+int split_packet(struct sender_session *sender, struct rudp_packet *p);
+int send_syn_ack(struct sockets *socket, struct sockaddr_in *to, u_int32_t seqno);
+int set_mss(struct sockets *socket, struct sender_session *sender, struct rudp_packet *syn_ack);
+void send_probe(struct sender_session *sender);
+int probeTimeoutCallback(int fd, void *arg);
+int rudp_unpack(struct rudp_wirehdr *wh, int len, struct rudp_packet *p);
+struct receiver_session *new_receiver_session(struct sockets *socket, struct sockaddr_in *peer, u_int32_t syn_seqno);
+struct sender_session *new_sender_session(struct sockets *socket, struct sockaddr_in *peer);
+void free_receiver_session(struct receiver_session *receiver);
+void free_sender_session(struct sender_session *sender);
+void free_socket(struct sockets *socket);
+int add_socket(struct sockets *socket);
+rudp_socket_t open_socket(int port, int reuseport);
+struct sockets *find_socket(rudp_socket_t rsocket);
+struct sockets *hold_socket(rudp_socket_t rsocket);
+void release_socket(rudp_socket_t rsocket);
+u_int32_t session_hash(struct sockaddr_in *addr);
+struct session *find_session(struct sockets *socket, struct sockaddr_in *addr);
+struct session *new_session(struct sockets *socket, struct sockaddr_in *addr);
+int session_table_insert(struct sockets *socket, struct session *session);
+void remove_session(struct sockets *socket, struct session *session);
+void free_session(struct session *session);
+void finish_session(struct sockets *socket, struct session *session);
+void evict_sessions(struct sockets *socket);
+long rtt_sample(struct sender_session *sender, struct timeval *sent_time);
+int rto_backoff(struct sender_session *sender, long timer_rto);
+struct window_slot *window_slot(struct sender_session *sender, u_int32_t seqno);
+int window_ack(struct sender_session *sender, struct rudp_packet *ack, long *rtt);
+void fill_window(struct sockets *socket, struct session *session);
+void fast_retransmit(struct sockets *socket, struct session *session);
+u_int32_t ring_size(int window);
+int send_ack(struct sockets *socket, struct sockaddr_in *to, u_int32_t seqno);
+int send_data_ack(struct sockets *socket, struct sockaddr_in *to, struct receiver_session *receiver);
+int delay_ack(struct receiver_session *receiver);
+int ackTimeoutCallback(int fd, void *arg);
+u_int32_t rudp_random(void);
+
+// State of the random number generator of the sockets of this thread, so
+// that the loops of several threads share nothing
+__thread unsigned int rng_state;
+__thread int rng_seeded = 0;
 
 /*
  * rudp_socket: Create a RUDP socket.
  * May use a random port by setting port to zero.
  */
 rudp_socket_t rudp_socket(int port) {
-	// Seed random number generator
-	if(rng_seeded ==0) {
-		srand(time(NULL));
-		rng_seeded = 1;
-	}
+	return open_socket(port, 0);
+}
+
+/*
+ * rudp_socket_reuseport: Create a RUDP socket that shares port with the
+ * other sockets opened on it with this function, typically one per
+ * thread and event loop. The kernel steers the datagrams of each peer
+ * to one of them, so a session is handled by one thread only.
+ */
+rudp_socket_t rudp_socket_reuseport(int port) {
+	return open_socket(port, 1);
+}
+
+rudp_socket_t open_socket(int port, int reuseport) {
 	int sockfd;
 	struct sockaddr_in address;
 
@@ -113,475 +384,600 @@ rudp_socket_t rudp_socket(int port) {
 	address.sin_addr.s_addr = htonl(INADDR_ANY);
 	address.sin_port = htons(port);
 
+	if(reuseport) {
+		int on = 1;
+		if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			perror("setsockopt SO_REUSEPORT");
+			close(sockfd);
+			return NULL;
+		}
+	}
+
 	if( bind(sockfd, (struct sockaddr *) &address, sizeof(address)) < 0) {
 		perror("bind");
 		return NULL;
 	}
 
-	rudp_socket_t socket = (rudp_socket_t)sockfd;
-
-	// Create new sockets struct and add to list of sockets
+	// Create new sockets struct and add it to the table of sockets
 	struct sockets *newSocket = malloc(sizeof(struct sockets));
-	newSocket->rsock = socket;
+	newSocket->fd = sockfd;
 	newSocket->closeRequested=0;
+	newSocket->window = RUDP_WINDOW;
+	newSocket->rto_min = RUDP_MINRTO;
+	newSocket->rto_max = RUDP_MAXRTO;
+	newSocket->cc = RUDP_CC_RENO;
+	newSocket->ack_every = RUDP_ACK_EVERY;
+	newSocket->ack_delay = RUDP_ACK_DELAY;
+	newSocket->recv_loan = 0;
+	newSocket->mss = RUDP_MAXPKTSIZE;
+	newSocket->stream_delay = RUDP_STREAM_DELAY;
+	newSocket->sndbuf = RUDP_SNDBUF;
+	newSocket->pmtud = 0;
+	newSocket->loss = 0;
 	newSocket->sessions_list_head = NULL;
-	newSocket->next = NULL;
+	newSocket->session_table = NULL;
+	newSocket->session_mask = 0;
+	newSocket->sessions = 0;
+	newSocket->session_slots_used = 0;
+	newSocket->finished_head = NULL;
+	newSocket->finished_tail = NULL;
+	newSocket->finished = 0;
+	pool_init(&newSocket->packets, sizeof(struct rudp_packet) + newSocket->mss);
+	pool_init(&newSocket->refs, sizeof(struct rudp_packet));
+	pool_init(&newSocket->shared, sizeof(struct rudp_shared) + newSocket->mss);
+	newSocket->io = malloc(sizeof(struct io_batch));
+	if(newSocket->io == NULL) {
+		perror("rudp_socket: malloc");
+		close(sockfd);
+		free(newSocket);
+		return NULL;
+	}
+	bzero(newSocket->io->rx, sizeof(newSocket->io->rx));
+	newSocket->io->tx_count = 0;
+	newSocket->io->deferring = 0;
+	newSocket->io->sent_head = NULL;
+	newSocket->io->sent_tail = NULL;
+	newSocket->submit_head = NULL;
+	newSocket->submit_signalled = 0;
+	newSocket->submit_closed = 0;
+	memset(newSocket->submitted, 0, sizeof(newSocket->submitted));
+	newSocket->backlog = NULL;
+	newSocket->backlog_tail = NULL;
+	bzero(&newSocket->group, sizeof(newSocket->group));
+	newSocket->members = 0;
+	newSocket->group_opening = 0;
+	newSocket->group_sending = 0;
+	newSocket->group_seq = 0;
+	bzero(newSocket->repairs, sizeof(newSocket->repairs));
+	newSocket->group_fd = -1;
+#ifdef HAVE_EVENTFD
+	newSocket->submit_fd[0] = newSocket->submit_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(newSocket->submit_fd[0] < 0) {
+		perror("rudp_socket: eventfd");
+#else
+	if(pipe(newSocket->submit_fd) < 0 || fcntl(newSocket->submit_fd[0], F_SETFL, O_NONBLOCK) < 0 ||
+	   fcntl(newSocket->submit_fd[1], F_SETFL, O_NONBLOCK) < 0) {
+		perror("rudp_socket: pipe");
+#endif
+		close(sockfd);
+		free(newSocket->io);
+		free(newSocket);
+		return NULL;
+	}
 	newSocket->handler=NULL;
+	newSocket->sent_handler=NULL;
 	newSocket->recv_handler=NULL;
-
-	if(sockets_list_head == NULL) {
-		sockets_list_head = newSocket;
-	}
-	else {
-		struct sockets *temp = sockets_list_head;
-		while(temp->next != NULL) {
-			temp = temp->next;
-		}
-		temp->next = newSocket;
+	if(add_socket(newSocket) < 0) {
+		close(sockfd);
+		close(newSocket->submit_fd[0]);
+		if(newSocket->submit_fd[1] != newSocket->submit_fd[0])
+			close(newSocket->submit_fd[1]);
+		free(newSocket->io);
+		free(newSocket);
+		return NULL;
 	}
 
 	// Register callback event for this socket descriptor
-	if(event_fd(sockfd,receiveCallback, sockfd, "receiveCallback") < 0) {
+	if(event_fd(sockfd,receiveCallback, newSocket, "receiveCallback") < 0) {
 		fprintf(stderr, "Error registering receive callback function");
 	}
+	if(event_fd(newSocket->submit_fd[0], submitCallback, newSocket, "submitCallback") < 0) {
+		fprintf(stderr, "Error registering submit callback function");
+	}
 
-	return socket;
+	return newSocket->rsock;
 }
 
-/* Callback function executed when something is received on fd */
+/*
+ * Callback function executed when something is received on fd. Reads
+ * everything that is queued, since the event loop may only tell us about
+ * new input. With recvmmsg, up to RUDP_RECV_BATCH datagrams are read with
+ * one system call, and the packets sent in reply to them are held back
+ * and sent together with sendmmsg once the batch has been handled.
+ */
 int receiveCallback(int file, void *arg)
 {
-	char buf[sizeof(struct rudp_packet)];
-	struct sockaddr_in sender;
-	size_t sender_length = sizeof(struct sockaddr_in);
-	recvfrom(file, &buf, sizeof(struct rudp_packet), 0, (struct sockaddr *)&sender, &sender_length);
+	struct sockets *socket = arg;
+	struct io_batch *io = socket->io;
+	struct iovec iov[RUDP_RECV_BATCH][2];
+	int i, n, batch;
+
+	// Replace the packets that were kept from the last batch
+	for(batch = 0; batch < RUDP_RECV_BATCH; batch++) {
+		if(io->rx[batch] == NULL && (io->rx[batch] = packet_get(socket)) == NULL)
+			break;
+		iov[batch][0].iov_base = &io->rx_hdr[batch];
+		iov[batch][0].iov_len = RUDP_HDRLEN;
+		iov[batch][1].iov_base = io->rx[batch]->payload;
+		iov[batch][1].iov_len = socket->mss;
+	}
+	if(batch == 0)
+		return 0;
+
+#ifdef HAVE_MMSG
+	struct mmsghdr msgs[RUDP_RECV_BATCH];
+	bzero(msgs, sizeof(msgs));
+	for(i = 0; i < batch; i++) {
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+		msgs[i].msg_hdr.msg_name = &io->rx_from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	n = recvmmsg(file, msgs, batch, MSG_DONTWAIT, NULL);
+	if(n < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("receiveCallback: recvmmsg");
+		return 0;
+	}
+	for(i = 0; i < n; i++)
+		io->rx_len[i] = msgs[i].msg_len;
+#else
+	for(n = 0; n < batch; n++) {
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = iov[n];
+		msg.msg_iovlen = 2;
+		msg.msg_name = &io->rx_from[n];
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		int len = recvmsg(file, &msg, MSG_DONTWAIT);
+		if(len < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("receiveCallback: recvmsg");
+			break;
+		}
+		io->rx_len[n] = len;
+	}
+#endif
+
+	io->deferring = 1;
+	for(i = 0; i < n; i++) {
+		int closed = receive_packet(socket, &io->rx_hdr[i], &io->rx[i], io->rx_len[i], &io->rx_from[i]);
+		if(closed < 0)
+			return -1;
+		if(closed > 0)
+			return 0; // The socket and its buffers are gone
+	}
+	io->deferring = 0;
+	flush_sends(socket);
+	complete_packets(socket);
+	return 0;
+}
+
+/*
+ * Callback function executed when DATA sent to the multicast group the
+ * socket has joined is received. It is handled like any other packet of
+ * its sender.
+ */
+int groupCallback(int fd, void *arg) {
+	return receiveCallback(fd, arg);
+}
+
+/*
+ * queue_send: Hold a packet back to be sent by flush_sends. Its payload is
+ * not copied: a DATA packet that is released before then is kept by
+ * release_packet until the batch has been sent. Only ACKs, which are built
+ * on the stack, have their payload copied.
+ */
+void queue_send(struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient) {
+	struct io_batch *io = socket->io;
+	if(io->tx_count == RUDP_SEND_BATCH)
+		flush_sends(socket);
+	struct iovec *iov = io->tx_iov[io->tx_count];
+	struct rudp_wirehdr *wh = (struct rudp_wirehdr *)io->tx[io->tx_count];
+	io->tx_iovcnt[io->tx_count] = packet_iov(p, wh, iov);
+	if(p->header.type == RUDP_ACK) {
+		bcopy(p->payload, wh + 1, p->payload_length);
+		iov[1].iov_base = wh + 1;
+	}
+	io->tx_to[io->tx_count] = *recipient;
+	io->tx_count++;
+}
+
+/*
+ * flush_sends: Send the packets held back by queue_send.
+ */
+void flush_sends(struct sockets *socket) {
+	struct io_batch *io = socket->io;
+	int i = 0;
+
+#ifdef HAVE_MMSG
+	struct mmsghdr msgs[RUDP_SEND_BATCH];
+	bzero(msgs, io->tx_count * sizeof(struct mmsghdr));
+	for(i = 0; i < io->tx_count; i++) {
+		msgs[i].msg_hdr.msg_iov = io->tx_iov[i];
+		msgs[i].msg_hdr.msg_iovlen = io->tx_iovcnt[i];
+		msgs[i].msg_hdr.msg_name = &io->tx_to[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	i = 0;
+	while(i < io->tx_count) {
+		int n = sendmmsg(socket->fd, &msgs[i], io->tx_count - i, 0);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			// Skip the packet that failed, like a lost one
+			if(errno != EMSGSIZE)
+				fprintf(stderr, "rudp_sendto: sendmmsg failed\n");
+			n = 1;
+		}
+		i += n;
+	}
+#else
+	for(i = 0; i < io->tx_count; i++) {
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = io->tx_iov[i];
+		msg.msg_iovlen = io->tx_iovcnt[i];
+		msg.msg_name = &io->tx_to[i];
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		if(sendmsg(socket->fd, &msg, 0) < 0 && errno != EMSGSIZE)
+			fprintf(stderr, "rudp_sendto: sendmsg failed\n");
+	}
+#endif
+	io->tx_count = 0;
+}
 
-	struct rudp_packet *received_packet = malloc(sizeof(struct rudp_packet));
-	bcopy(&buf, received_packet, sizeof(struct rudp_packet));
+/*
+ * receive_packet: Handle a datagram of len bytes that was received on
+ * socket from the peer at from, with header wh and its payload in *pp.
+ * If the packet is kept, *pp is set to NULL. Returns 1 if the socket has
+ * been closed.
+ */
+int receive_packet(struct sockets *socket, struct rudp_wirehdr *wh, struct rudp_packet **pp, int len, struct sockaddr_in *from)
+{
+	struct sockaddr_in sender = *from;
+	struct rudp_packet *received_packet = *pp;
+	if(rudp_unpack(wh, len, received_packet) < 0) {
+		RUDP_LOG(RUDP_LOG_WARN, RUDP_LOG_PACKET, RUDP_LOGEV_MALFORMED, len, sender.sin_addr.s_addr, sender.sin_port, 0, 0);
+		return 0;
+	}
 
 	struct rudp_hdr rudpheader = received_packet->header;
-	char *type=malloc(5);
-	int t=rudpheader.type;
-	if(t==1)
-		type="DATA";
-	else if(t==2)
-		type="ACK";
-	else if(t==4)
-		type="SYN";
-	else if(t==5)
-		type="FIN";
+	RUDP_LOG(RUDP_LOG_TRACE, RUDP_LOG_PACKET, RUDP_LOGEV_RECV, rudpheader.type, sender.sin_addr.s_addr, sender.sin_port, rudpheader.seqno, socket->fd);
+
+	// See if a session already exists for this peer
+	struct session *temp2 = find_session(socket, &sender);
+	if(temp2 == NULL) {
+		//No session was found for this peer
+		if(rudpheader.type == RUDP_SYN) {
+			// SYN Received. Create a new session
+			temp2 = new_session(socket, &sender);
+			if(temp2 == NULL)
+				return 0;
+			temp2->receiver = new_receiver_session(socket, temp2->address, rudpheader.seqno);
+
+			// ACK
+			send_syn_ack(socket, &sender, temp2->receiver->expected_seqNo);
+		}
+		else {
+			//Session does not exist and we received non SYN
+			// We ignore it
+		}
+	}
 	else
-		type="BAD";
+	{
+		//We did find a session for this peer
+		if(rudpheader.type == RUDP_SYN) {
+			if(temp2->receiver != NULL && temp2->receiver->status==OPENING && !temp2->receiver->sessionFinished &&
+			   rudpheader.seqno+(u_int32_t)1 == temp2->receiver->expected_seqNo) {
+				// The peer sent the SYN again, because our ACK of it was lost or
+				// is late. ACK it again, keeping the DATA that has already been
+				// buffered and SACKed.
+				send_syn_ack(socket, &sender, temp2->receiver->expected_seqNo);
+			}
+			else if(temp2->receiver == NULL || temp2->receiver->status==OPENING || temp2->receiver->sessionFinished) {
+				// We have a sender session already with this peer, but not a receiver session,
+				// or the peer starts over after a FIN. So we create a receiver session with the peer
+				if(temp2->receiver != NULL)
+					free_receiver_session(temp2->receiver);
+				temp2->receiver = new_receiver_session(socket, temp2->address, rudpheader.seqno);
 
-	printf("Received %s packet from %s:%d seq number=%u on socket=%d\n",type, inet_ntoa(sender.sin_addr), ntohs(sender.sin_port),rudpheader.seqno,file);
+				// ACK
+				send_syn_ack(socket, &sender, temp2->receiver->expected_seqNo);
 
-	// Locate the correct socket in the socket list
-	if(sockets_list_head == NULL) {
-		fprintf(stderr, "Error: Attempt to receive on invalid socket. No sockets in the list\n");
-		return -1;
-	}
-	else {
-		//We have sockets to check
-		struct sockets *temp = sockets_list_head;
-		while(temp != NULL) {
-			if(temp->rsock == file) {
-				break;
 			}
-			temp = temp->next;
+			else {
+				//Received a SYN when there is already an active receiver session, so we ignore it
+			}
 		}
-		if(temp->rsock == file) {
-			// We found the correct socket, now see if a session already exists for this peer
-			if(temp->sessions_list_head == NULL) {
-				// The list is empty, so we check if the sender has initiated the protocol properly (by sending a SYN)
-				if(rudpheader.type == RUDP_SYN) {
-					// SYN Received. Create a new session at the head of the list
-					struct session *new_session = malloc(sizeof(struct session));
-					new_session->address = malloc(sizeof(struct sockaddr_in));
-					bcopy(&sender, new_session->address, sizeof(struct sockaddr_in));
-					new_session->next=NULL;
-					new_session->sender = NULL;
-					new_session->receiver = malloc(sizeof(struct receiver_session));
-					struct receiver_session *new_receiver_session = malloc(sizeof(struct receiver_session));
-					new_receiver_session->status = OPENING;
-					new_receiver_session->sessionFinished=0;
-					new_receiver_session->expected_seqNo = (rudpheader.seqno+(u_int32_t)1);
-					new_session->receiver=new_receiver_session;
-					temp->sessions_list_head = new_session;
-
-					// ACK
-					struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-					ack->type=RUDP_ACK;
-					ack->version=RUDP_VERSION;
-					ack->seqno=new_session->receiver->expected_seqNo;
-					struct rudp_packet *p2 = malloc(sizeof(struct rudp_packet));
-					p2->header = *ack;
-					p2->payload_length = 0;
-					send_packet(1, file, p2, &sender,0);
-				}
-				else {
-					//No sessions exist and we got a non syn packet
-					//We ignore this
+		if(rudpheader.type == RUDP_ACK)
+		{
+			//We receive an ACK
+			u_int32_t ack_sqn=received_packet->header.seqno;
+			if(temp2->sender->status==SYN_SENT)
+			{
+				//This an ACK for a SYN
+				u_int32_t syn_sqn=temp2->sender->seqNo;
+				if( (ack_sqn-(u_int32_t)1) == syn_sqn)
+				{
+					//Deleting the retransmission timeout
+					event_timer_cancel(temp2->sender->syn_timer);
+					//Karn's rule: a retransmitted SYN gives no RTT sample
+					if(temp2->sender->syn_retransmit_attempts == 0)
+						rtt_sample(temp2->sender, &temp2->sender->syn_sent_time);
+					temp2->sender->status=OPEN;
+					if(set_mss(socket, temp2->sender, received_packet) < 0) {
+						// The member is refused, as if it had not answered. Nothing
+						// is sent to the group for it, and it holds the group back.
+						if(socket->handler != NULL)
+							socket->handler(socket->rsock, RUDP_EVENT_TIMEOUT, &sender);
+						return 0;
+					}
+					fill_window(socket, temp2);
+					check_writable(socket, temp2);
 				}
 			}
-			else {
-				//Some sessions are there to be checked
-				int sessionFound = 0;
-				// Check if we already have a session for this peer
-				struct session *temp2 = temp->sessions_list_head;
-				struct session *last_session;
-				while(temp2 != NULL) {
-					if(temp2->next == NULL) {
-						last_session = temp2;
-					}
-					if(temp2->address->sin_addr.s_addr == sender.sin_addr.s_addr && temp2->address->sin_port == sender.sin_port && temp2->address->sin_family == sender.sin_family) {
-						// Found an existing session
-						sessionFound = 1;
-						break;
+			else if(temp2->sender->status==OPEN && (received_packet->header.flags & RUDP_FLAG_SYNACK))
+			{
+				// A duplicate ACK of our SYN, e.g. of a retransmitted one. Its
+				// payload is an MSS, not a SACK bitmap, so it says nothing about
+				// the DATA in the window.
+			}
+			else if(temp2->sender->status==OPEN)
+			{
+				//This is an ACK for DATA
+				struct sender_session *s = temp2->sender;
+				u_int32_t old_base = s->window_base;
+				long rtt;
+				int acked = window_ack(s, received_packet, &rtt);
+				// With two or three packets in flight and nothing else that the
+				// window lets us send, there are not enough ACKs to wait for
+				// three (early retransmit, RFC 5827)
+				int dupthresh = RUDP_CC_DUPACKS;
+				if(s->in_flight >= 2 && s->in_flight <= RUDP_CC_DUPACKS &&
+				   (s->data_queue == NULL || s->in_flight >= s->window_size))
+					dupthresh = s->in_flight - 1;
+				if(s->window_base != old_base)
+				{
+					s->dupacks = 0;
+					if(s->cc.in_recovery)
+					{
+						if(SEQ_GT(s->window_base, s->recover))
+							s->cc.in_recovery = 0;
+						else
+							fast_retransmit(socket, temp2); // Partial ACK: the next packet was lost too
 					}
-
-					temp2 = temp2->next;
 				}
-				if(sessionFound == 0) {
-					//No session was found for this peer
-					if(rudpheader.type == RUDP_SYN) {
-						// SYN Received. Create a new session at the head of the list
-						struct session *new_session = malloc(sizeof(struct session));
-						new_session->address = malloc(sizeof(struct sockaddr_in));
-						bcopy(&sender, new_session->address, sizeof(struct sockaddr_in));
-						new_session->next=NULL;
-						new_session->sender = NULL;
-						new_session->receiver = malloc(sizeof(struct receiver_session));
-						struct receiver_session *new_receiver_session = malloc(sizeof(struct receiver_session));
-						new_receiver_session->status = OPENING;
-						new_receiver_session->sessionFinished=0;
-						new_receiver_session->expected_seqNo = (rudpheader.seqno+(u_int32_t)1);
-						new_session->receiver=new_receiver_session;
-						last_session->next = new_session;
-
-						// ACK
-						struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-						ack->type=RUDP_ACK;
-						ack->version=RUDP_VERSION;
-						ack->seqno=new_session->receiver->expected_seqNo;
-						struct rudp_packet *p2 = malloc(sizeof(struct rudp_packet));
-						p2->header = *ack;
-						p2->payload_length = 0;
-						send_packet(1, file, p2, &sender,0);
-					}
-					else {
-						//Session does not exist and we received non SYN
-						// We ignore it
-					}
+				else if(s->in_flight > 0 && ++s->dupacks >= dupthresh && !s->cc.in_recovery)
+				{
+					// The packet at window_base was lost
+					rudp_cc_loss(&s->cc, s->in_flight);
+					s->cc.in_recovery = 1;
+					s->recover = s->seqNo;
+					fast_retransmit(socket, temp2);
 				}
-				else
+				if(acked > 0)
 				{
-					//We did find a session for this peer
-					if(rudpheader.type == RUDP_SYN) {
-						if(temp2->receiver == NULL || temp2->receiver->status==OPENING) {
-							// We have a sender session already with this peer, but not a receiver session
-							// So we create a receiver session with the peer
-							struct receiver_session *new_receiver_session= malloc(sizeof(struct receiver_session));
-							new_receiver_session->expected_seqNo = (rudpheader.seqno+(u_int32_t)1);
-							new_receiver_session->status = OPENING;
-							new_receiver_session->sessionFinished = 0;
-							temp2->receiver = malloc(sizeof(struct receiver_session));
-							temp2->receiver = new_receiver_session;
-
-							// ACK
-							struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-							ack->type=RUDP_ACK;
-							ack->version=RUDP_VERSION;
-							ack->seqno=temp2->receiver->expected_seqNo;
-							struct rudp_packet *p2 = malloc(sizeof(struct rudp_packet));
-							p2->header = *ack;
-							p2->payload_length = 0;
-							send_packet(1, file, p2, &sender,0);
+					rudp_cc_ack(&s->cc, acked, rtt);
+					fill_window(socket, temp2);
+					check_writable(socket, temp2);
 
-						}
-						else {
-							//Received a SYN when there is already an active receiver session, so we ignore it
-						}
-					}
-					if(rudpheader.type == RUDP_ACK)
+					//Checking for close req
+					if(socket->closeRequested==1)
 					{
-						//We receive an ACK
-						u_int32_t ack_sqn=received_packet->header.seqno;
-						if(temp2->sender->status==SYN_SENT)
+						//Can it be closed now?
+						struct session *head_sessions=socket->sessions_list_head;
+						while(head_sessions!=NULL)
 						{
-							//This an ACK for a SYN
-							u_int32_t syn_sqn=temp2->sender->seqNo;
-							if( (ack_sqn-(u_int32_t)1) == syn_sqn)
+							if(head_sessions->sender != NULL && head_sessions->sender->sessionFinished!=1)
 							{
-								//Deleting the retransmission timeout
-								event_timeout_delete(timeoutCallback,temp2->sender->syn_timeout_arg);
-								temp2->sender->status=OPEN;
-								while(temp2->sender->data_queue!=NULL)
+								if(head_sessions->sender->data_queue==NULL && head_sessions->sender->in_flight==0 && head_sessions->sender->status==OPEN)
 								{
-									// Break if the window is already full
-									if(temp2->sender->sliding_window[RUDP_WINDOW-1]!=NULL)
-									{
-										break;
-									}
-									else{
-										int index;
-										int i;
-										//Finding the first unused window slot
-										for(i = RUDP_WINDOW-1; i >= 0; i--) {
-											if(temp2->sender->sliding_window[i]==NULL) {
-												index = i;
-											}
-										}
-										//Send the packet and add it to window and remove from the queue
-										struct rudp_hdr *datah=malloc(sizeof(struct rudp_hdr));
-										datah->type=RUDP_DATA;
-										datah->version=RUDP_VERSION;
-										datah->seqno=++syn_sqn;
-										temp2->sender->seqNo+=1;
-										struct rudp_packet *datap=malloc(sizeof(struct rudp_packet));
-										bcopy(datah,&datap->header,sizeof(struct rudp_hdr));
-										bcopy(&temp2->sender->data_queue->len,&datap->payload_length,sizeof(int));
-										bcopy(temp2->sender->data_queue->item,&datap->payload,datap->payload_length);
-										temp2->sender->sliding_window[index]=datap;
-										temp2->sender->retransmission_attempts[index]=0;
-										temp2->sender->data_queue=temp2->sender->data_queue->next;
-										send_packet(0,file,datap,&sender,0);
-									}
+									struct rudp_packet fin;
+									fin.header.type=RUDP_FIN;
+									fin.header.version=RUDP_VERSION;
+									fin.header.flags=0;
+									head_sessions->sender->seqNo+=1;
+									fin.header.seqno=head_sessions->sender->seqNo;
+									fin.payload_length = 0;
+									fin.payload = NULL;
+									fin.iovcnt = 0;
+									send_packet(0, socket, &fin, head_sessions->address,0);
+									head_sessions->sender->status=FIN_SENT;
 								}
 							}
+							head_sessions=head_sessions->next;
 						}
-						else if(temp2->sender->status==OPEN)
+					}
+				}
+			}
+			else if(temp2->sender->status==FIN_SENT)
+			{
+				//Handling any ack for fin
+				if( (temp2->sender->seqNo+(u_int32_t)1) == received_packet->header.seqno)
+				{
+					event_timer_cancel(temp2->sender->fin_timer);
+					temp2->sender->sessionFinished=1;
+					finish_session(socket, temp2);
+					if(socket->closeRequested==1)
+					{
+						//Can it be closed now?
+						struct session *head_sessions=socket->sessions_list_head;
+						int allDone=1;
+						while(head_sessions!=NULL)
 						{
-							//This is an ACK for DATA
-							if(temp2->sender->sliding_window[0]!=NULL)
+							//printf("head_sessions->sender->sessionFinished = %d, head_session->receiver->sessionFinished = %d\n", head_sessions->sender->sessionFinished, head_sessions->receiver->sessionFinished);
+							if(head_sessions->sender->sessionFinished==0)
 							{
-								//checking if ack for the first item in the window
-								if(temp2->sender->sliding_window[0]->header.seqno == (rudpheader.seqno-(u_int32_t)1))
-								{
-									//We got correct ack
-									//Removing the first window item and shifting the rest left
-									event_timeout_delete(timeoutCallback,temp2->sender->data_timeout_arg[0]);
-									int i;
-									if(RUDP_WINDOW==1) {
-										temp2->sender->sliding_window[0] = NULL;
-										temp2->sender->retransmission_attempts[0] = 0;
-										temp2->sender->data_timeout_arg[0] = NULL;
-									}
-									else {
-										for(i = 0; i < RUDP_WINDOW - 1; i++) {
-											temp2->sender->sliding_window[i] = temp2->sender->sliding_window[i+1];
-											temp2->sender->retransmission_attempts[i] = temp2->sender->retransmission_attempts[i+1];
-											temp2->sender->data_timeout_arg[i] = temp2->sender->data_timeout_arg[i+1];
-
-											if(i == RUDP_WINDOW-2) {
-												temp2->sender->sliding_window[i+1]=NULL;
-												temp2->sender->retransmission_attempts[i+1]=0;
-												temp2->sender->data_timeout_arg[i+1] = NULL;
-											}
-										}
-									}
-
-									while(temp2->sender->data_queue!=NULL)
-									{
-										if(temp2->sender->sliding_window[RUDP_WINDOW-1]!=NULL)
-										{
-											break;
-										}
-										else{
-											int index;
-											int i;
-											//Finding the first unused window
-											for(i = RUDP_WINDOW-1; i >= 0; i--) {
-												if(temp2->sender->sliding_window[i]==NULL) {
-													index = i;
-												}
-											}
-											//Send the packet and add it to window and remove from the queue
-											struct rudp_hdr *datah=malloc(sizeof(struct rudp_hdr));
-											datah->type=RUDP_DATA;
-											datah->version=RUDP_VERSION;
-											//datah->seqno=ack_sqn;
-											temp2->sender->seqNo = (temp2->sender->seqNo + (u_int32_t)1);
-											datah->seqno=temp2->sender->seqNo;
-											struct rudp_packet *datap=malloc(sizeof(struct rudp_packet));
-											bcopy(datah,&datap->header,sizeof(struct rudp_hdr));
-											bcopy(&temp2->sender->data_queue->len,&datap->payload_length,sizeof(int));
-											bcopy(temp2->sender->data_queue->item,&datap->payload,datap->payload_length);
-											temp2->sender->sliding_window[index]=datap;
-											temp2->sender->retransmission_attempts[index]=0;
-											temp2->sender->data_queue=temp2->sender->data_queue->next;
-											send_packet(0,file,datap,&sender,0);
-										}
-									}
-									//Checking for close req
-									if(temp->closeRequested==1)
-									{
-										//Can it be closed now?
-										struct session *head_sessions=temp->sessions_list_head;
-										while(head_sessions!=NULL)
-										{
-											if(head_sessions->sender->sessionFinished!=1)
-											{
-												if(head_sessions->sender->data_queue==NULL &&  head_sessions->sender->sliding_window[0]==NULL && head_sessions->sender->status==OPEN)
-												{
-													struct rudp_hdr *fin=malloc(sizeof(struct rudp_hdr));
-													fin->type=RUDP_FIN;
-													fin->version=RUDP_VERSION;
-													head_sessions->sender->seqNo+=1;
-													fin->seqno=head_sessions->sender->seqNo;
-													struct rudp_packet *p = malloc(sizeof(struct rudp_packet));
-													bcopy(fin, &p->header,sizeof(struct rudp_hdr));
-													p->payload_length = 0;
-													send_packet(0, file, p, head_sessions->address,0);
-													head_sessions->sender->status=FIN_SENT;
-												}
-											}
-											head_sessions=head_sessions->next;
-										}
-									}
-								}
+								allDone=0;
 							}
-						}
-						else if(temp2->sender->status==FIN_SENT)
-						{
-							//Handling any ack for fin
-							if( (temp2->sender->seqNo+(u_int32_t)1) == received_packet->header.seqno)
+							else if(head_sessions->receiver != NULL && head_sessions->receiver->sessionFinished==0)
 							{
-								event_timeout_delete(timeoutCallback,temp2->sender->fin_timeout_arg);
-								temp2->sender->sessionFinished=1;
-								if(temp->closeRequested==1)
-								{
-									//Can it be closed now?
-									struct session *head_sessions=temp->sessions_list_head;
-									int allDone=1;
-									while(head_sessions!=NULL)
-									{
-										//printf("head_sessions->sender->sessionFinished = %d, head_session->receiver->sessionFinished = %d\n", head_sessions->sender->sessionFinished, head_sessions->receiver->sessionFinished);
-										if(head_sessions->sender->sessionFinished==0)
-										{
-											allDone=0;
-										}
-										else if(head_sessions->receiver != NULL && head_sessions->receiver->sessionFinished==0)
-										{
-											allDone = 0;
-										}
-
-										head_sessions=head_sessions->next;
-									}
-									if(allDone==1)
-									{
-										if(temp->handler!=NULL)
-										{
-											temp->handler((rudp_socket_t)file,RUDP_EVENT_CLOSED,&sender);
-											event_fd_delete(receiveCallback, file);
-											close(file);
-										}
-									}
-								}
+								allDone = 0;
 							}
-							else
+
+							head_sessions=head_sessions->next;
+						}
+						if(allDone==1)
+						{
+							if(socket->handler!=NULL)
 							{
-								// Received Incorrect ACK for FIN
+								socket->handler(socket->rsock,RUDP_EVENT_CLOSED,&sender);
+								event_fd_delete(receiveCallback, socket);
+								flush_sends(socket);
+								close(socket->fd);
+								free_socket(socket);
+								return 1;
 							}
 						}
 					}
-					else if(rudpheader.type==RUDP_DATA)
-					{
-						//This is when we handle a data packet
+				}
+				else
+				{
+					// Received Incorrect ACK for FIN
+				}
+			}
+		}
+		else if(rudpheader.type==RUDP_DATA)
+		{
+			//This is when we handle a data packet
 
-						// If our receiver is OPENING, we can move it to OPEN if the correct DATA is received
-						if(temp2->receiver->status == OPENING) {
-							if(rudpheader.seqno==temp2->receiver->expected_seqNo)
-							{
-								temp2->receiver->status = OPEN;
-							}
-						}
+			// If our receiver is OPENING, we can move it to OPEN if the correct DATA is received
+			if(temp2->receiver->status == OPENING) {
+				if(rudpheader.seqno==temp2->receiver->expected_seqNo)
+				{
+					temp2->receiver->status = OPEN;
+				}
+			}
 
-						if(rudpheader.seqno==temp2->receiver->expected_seqNo)
+			if(rudpheader.seqno==temp2->receiver->expected_seqNo)
+			{
+				temp2->receiver->expected_seqNo=(rudpheader.seqno+(u_int32_t)1);
+
+				//Passing the data to the application
+				if(deliver_packet(socket, temp2->receiver, &sender, received_packet))
+					*pp = NULL;
+
+				//The gap is filled, so pass on any buffered packets that are now in order
+				struct receiver_session *rs = temp2->receiver;
+				struct rudp_packet **slot = &rs->reorder_buffer[rs->expected_seqNo & rs->window_mask];
+				while(rs->buffered > 0 && *slot != NULL && (*slot)->header.seqno == rs->expected_seqNo) {
+					struct rudp_packet *buffered = *slot;
+					*slot = NULL;
+					rs->buffered--;
+					rs->expected_seqNo++;
+					if(!deliver_packet(socket, rs, &sender, buffered))
+						pool_put(rs->packets, buffered);
+					slot = &rs->reorder_buffer[rs->expected_seqNo & rs->window_mask];
+				}
+				//One cumulative ACK covers this packet and every buffered one we passed on
+				delay_ack(temp2->receiver);
+			}
+			// Out of order, but within the window: buffer it until the gap is filled
+			else if(SEQ_GT(rudpheader.seqno, temp2->receiver->expected_seqNo) &&
+					SEQ_LT(rudpheader.seqno, (temp2->receiver->expected_seqNo+(u_int32_t)temp2->receiver->window_size))) {
+				struct receiver_session *rs = temp2->receiver;
+				struct rudp_packet **slot = &rs->reorder_buffer[rudpheader.seqno & rs->window_mask];
+				if(*slot == NULL) {
+					*slot = received_packet;
+					*pp = NULL;
+					if(rs->buffered == 0 || SEQ_GT(rudpheader.seqno, rs->highest_seqNo))
+						rs->highest_seqNo = rudpheader.seqno;
+					rs->buffered++;
+				}
+				//The SACK bitmap tells the sender to retransmit only the missing packets
+				rs->quickacks = rs->window_size;
+				send_data_ack(socket, &sender, temp2->receiver);
+			}
+			// Handle the case where an ACK was lost
+			else if(SEQ_GEQ(rudpheader.seqno, (temp2->receiver->expected_seqNo-(u_int32_t)temp2->receiver->window_size)) &&
+					SEQ_LT(rudpheader.seqno, temp2->receiver->expected_seqNo)) {
+				temp2->receiver->quickacks = temp2->receiver->window_size;
+				send_data_ack(socket, &sender, temp2->receiver);
+			}
+		}
+		else if(rudpheader.type==RUDP_FIN)
+		{
+			//This is when we handle a FIN
+			if(temp2->receiver->status == OPEN) {
+				if(rudpheader.seqno==temp2->receiver->expected_seqNo)
+				{
+					// If the FIN is correct, we can ACK it
+					temp2->receiver->sessionFinished = 1;
+					event_timer_cancel(temp2->receiver->ack_timer); // This ACK covers any that was held back
+					temp2->receiver->ack_timer = EVENT_TIMER_NONE;
+					send_ack(socket, &sender, temp2->receiver->expected_seqNo+(u_int32_t)1);
+					finish_session(socket, temp2);
+
+					// See if we can close the socket
+					if(socket->closeRequested==1)
+					{
+						//Can it be closed now?
+						struct session *head_sessions=socket->sessions_list_head;
+						int allDone=1;
+						while(head_sessions!=NULL)
 						{
-							//The seq numbers match correctly and we ack the data
-							struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-							ack->type=RUDP_ACK;
-							ack->version=RUDP_VERSION;
-							//ack->seqno=(temp2->receiver->expected_seqNo+(u_int32_t)1)%UINT32_MAX;
-							ack->seqno=(rudpheader.seqno+(u_int32_t)1);
-							struct rudp_packet *p = malloc(sizeof(struct rudp_packet));
-							p->header = *ack;
-							p->payload_length = 0;
-							send_packet(1, file, p, &sender,0);
-							temp2->receiver->expected_seqNo=ack->seqno;
-							//temp2->receiver->expected_seqNo=(temp2->receiver->expected_seqNo+(u_int32_t)1)%UINT32_MAX;
-
-							//Passing the data to the application
-							if(temp->recv_handler!=NULL)
-								temp->recv_handler(file, &sender,(void*)&received_packet->payload,received_packet->payload_length);
+							if(head_sessions->sender->sessionFinished==0)
+								allDone=0;
+							else if(head_sessions->receiver != NULL && head_sessions->receiver->sessionFinished==0)
+								allDone = 0;
 
+							head_sessions=head_sessions->next;
 						}
-						// Handle the case where an ACK was lost
-						else if(SEQ_GEQ(rudpheader.seqno, (temp2->receiver->expected_seqNo-(u_int32_t)RUDP_WINDOW)) &&
-								SEQ_LT(rudpheader.seqno, temp2->receiver->expected_seqNo)) {
-							//The seq numbers match correctly and we ack the data
-							struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-							ack->type=RUDP_ACK;
-							ack->version=RUDP_VERSION;
-							ack->seqno=(rudpheader.seqno+(u_int32_t)1);
-							//temp2->receiver->expected_seqNo=ack->seqno;
-							struct rudp_packet *p = malloc(sizeof(struct rudp_packet));
-							p->header = *ack;
-							p->payload_length = 0;
-							send_packet(1, file, p, &sender,0);
-							//temp2->receiver->expected_seqNo=(temp2->receiver->expected_seqNo+(u_int32_t)1)%UINT32_MAX;
-						}
-					}
-					else if(rudpheader.type==RUDP_FIN)
-					{
-						//This is when we handle a FIN
-						if(temp2->receiver->status == OPEN) {
-							if(rudpheader.seqno==temp2->receiver->expected_seqNo)
-							{
-								// If the FIN is correct, we can ACK it
-								struct rudp_hdr *ack=malloc(sizeof(struct rudp_hdr));
-								ack->type=RUDP_ACK;
-								ack->version=RUDP_VERSION;
-								ack->seqno=(temp2->receiver->expected_seqNo+(u_int32_t)1);
-								struct rudp_packet *p2 = malloc(sizeof(struct rudp_packet));
-								p2->header = *ack;
-								p2->payload_length = 0;
-								temp2->receiver->sessionFinished = 1;
-								send_packet(1, file, p2, &sender,0);
-
-								// See if we can close the socket
-								if(temp->closeRequested==1)
-								{
-									//Can it be closed now?
-									struct session *head_sessions=temp->sessions_list_head;
-									int allDone=1;
-									while(head_sessions!=NULL)
-									{
-										if(head_sessions->sender->sessionFinished==0)
-											allDone=0;
-										else if(head_sessions->receiver != NULL && head_sessions->receiver->sessionFinished==0)
-											allDone = 0;
-
-										head_sessions=head_sessions->next;
-									}
-									if(allDone==1)
-									{
-										if(temp->handler!=NULL)
-										{
-											temp->handler(file,RUDP_EVENT_CLOSED,&sender);
-											event_fd_delete(receiveCallback, file);
-											close(file);
-										}
-									}
-								}
-							}
-							else
+						if(allDone==1)
+						{
+							if(socket->handler!=NULL)
 							{
-								//FIN received with bad seq no
+								socket->handler(socket->rsock,RUDP_EVENT_CLOSED,&sender);
+								event_fd_delete(receiveCallback, socket);
+								flush_sends(socket);
+								close(socket->fd);
+								free_socket(socket);
+								return 1;
 							}
 						}
 					}
 				}
+				else
+				{
+					//FIN received with bad seq no
+				}
+			}
+		}
+		else if(rudpheader.type==RUDP_PROBE)
+		{
+			// It arrived, so the path carries its size
+			struct rudp_packet probeack;
+			probeack.header.type = RUDP_PROBEACK;
+			probeack.header.version = RUDP_VERSION;
+			probeack.header.seqno = rudpheader.seqno;
+			probeack.header.flags = 0;
+			probeack.payload_length = 0;
+			probeack.payload = NULL;
+			probeack.iovcnt = 0;
+			send_packet(1, socket, &probeack, &sender, 0);
+		}
+		else if(rudpheader.type==RUDP_PROBEACK)
+		{
+			struct sender_session *s = temp2->sender;
+			if(s != NULL && s->probe_size > 0 && rudpheader.seqno == s->probe_seq)
+			{
+				event_timer_cancel(s->probe_timer);
+				s->probe_timer = EVENT_TIMER_NONE;
+				s->mss = s->probe_size;
+				s->probes++;
+				s->probe_tries = 0;
+				send_probe(s);
 			}
 		}
 	}
@@ -594,18 +990,18 @@ int receiveCallback(int file, void *arg)
  */ 
 
 int rudp_close(rudp_socket_t rsocket) {
-	struct sockets *temp = sockets_list_head;
-	while(temp->next != NULL) {
-		if(temp->rsock == rsocket) {
-			break;
-		}
-		temp = temp->next;
-	}
-	if(temp->rsock == rsocket) {
-		temp->closeRequested=1;
-		return 0;
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_close failed: invalid socket\n");
+		return -1;
 	}
-	return -1;
+	temp->closeRequested=1;
+
+	// Data of rudp_write that is held back is sent before the FIN
+	struct session *session;
+	for(session = temp->sessions_list_head; session != NULL; session = session->next)
+		flush_stream(temp, session);
+	return 0;
 }
 
 /* 
@@ -620,20 +1016,13 @@ int rudp_recvfrom_handler(rudp_socket_t rsocket,
 		fprintf(stderr, "rudp_recvfrom_handler failed: handler callback is null\n");
 		return -1;
 	}
-	// Find the proper socket from the socket list
-		struct sockets *temp = sockets_list_head;
-		while(temp->next != NULL) {
-			if(temp->rsock == rsocket) {
-				break;
-			}
-			temp = temp->next;
-		}
-		// Insert an extra check to handle case where invalid rsock is used
-		if(temp->rsock == rsocket) {
-			temp->recv_handler = handler;
-			return 0;
-		}
-	return -1;
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_recvfrom_handler failed: invalid socket\n");
+		return -1;
+	}
+	temp->recv_handler = handler;
+	return 0;
 }
 
 /* 
@@ -648,401 +1037,2316 @@ int rudp_event_handler(rudp_socket_t rsocket,
 		return -1;
 	}
 
-	// Find the proper socket from the socket list
-	struct sockets *temp = sockets_list_head;
-	while(temp->next != NULL) {
-		if(temp->rsock == rsocket) {
-			break;
-		}
-		temp = temp->next;
-	}
-	// Insert an extra check to handle case where invalid rsock is used
-	if(temp->rsock == rsocket) {
-		temp->handler = handler;
-		return 0;
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_event_handler failed: invalid socket\n");
+		return -1;
 	}
-	return -1;
+	temp->handler = handler;
+	return 0;
 }
 
-
-/* 
- * rudp_sendto: Send a block of data to the receiver. 
+/*
+ * rudp_sent_handler: Register the callback function that is told when
+ * the buffers of a rudp_sendv call may be reused
  */
+int rudp_sent_handler(rudp_socket_t rsocket,
+		      int (*handler)(rudp_socket_t, void *, int)) {
 
-int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
-
-	if(len < 0 || len > RUDP_MAXPKTSIZE) {
-		fprintf(stderr, "rudp_sendto Error: Attempting to send with invalid max packet size\n");
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_sent_handler failed: invalid socket\n");
 		return -1;
 	}
+	temp->sent_handler = handler;
+	return 0;
+}
 
-	if(rsocket < 0) {
-		fprintf(stderr, "rudp_sendto Error: Attempting to send on invalid socket\n");
+/*
+ * rudp_release: Give back data that was passed to the receive handler
+ * while RUDP_OPT_RECV_LOAN was set
+ */
+int rudp_release(rudp_socket_t rsocket, char *data) {
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_release failed: invalid socket\n");
 		return -1;
 	}
+	if(data == NULL)
+		return 0;
+	struct rudp_packet *p = (struct rudp_packet *)data - 1;
+	if(p->header.type == RUDP_MESSAGE)
+		free(p);
+	else
+		pool_put(&temp->packets, p);
+	return 0;
+}
 
-	if(to == NULL) {
-		fprintf(stderr, "rudp_sendto Error: Attempting to send to an invalid address\n");
+/*
+ * rudp_setsockopt: Set a socket option
+ */
+int rudp_setsockopt(rudp_socket_t rsocket, rudp_option_t option, int value) {
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_setsockopt failed: invalid socket\n");
 		return -1;
 	}
 
-	int new_session_created=1;
-	int seq_no=0;
-	if(sockets_list_head == NULL) {
-		fprintf(stderr, "Error: Attempt to send on invalid socket. No sockets in the list\n");
-		return -1;
-	}
-	else {
-		// Find the correct socket in our list
-		struct sockets *temp = sockets_list_head;
-		while(temp != NULL) {
-			if(temp->rsock == rsocket) {
-				break;
-			}
-			temp = temp->next;
+	switch(option) {
+	case RUDP_OPT_WINDOW:
+		if(value < 1 || value > RUDP_MAXWINDOW) {
+			fprintf(stderr, "rudp_setsockopt failed: window must be between 1 and %d\n", RUDP_MAXWINDOW);
+			return -1;
 		}
-		if(temp->rsock == rsocket) {
-			// We found the correct socket, now see if a session already exists for this peer
-			struct data *data_item = malloc(sizeof(struct data));
-			data_item->item=malloc(len);
-			bcopy(data,data_item->item,len);
-			data_item->len = len;
-			data_item->next = NULL;
-			if(temp->sessions_list_head == NULL) {
-				// The list is empty, so we create a new session at the head of the list
-				// This will be a sender address
-				struct session *new_session = malloc(sizeof(struct session));
-				new_session->address = to;
-				new_session->next = NULL;
-				new_session->receiver = NULL;
-				new_session->sender = malloc(sizeof(struct sender_session));
-				struct sender_session *new_sender_session = malloc(sizeof(struct sender_session));
-				new_sender_session->status=SYN_SENT;
-				//new_sender_session->seqNo = rand();
-				new_sender_session->seqNo = rand(); // HELP
-				new_sender_session->sessionFinished=0;
-				//Creating a new session and adding the data to the queue
-				new_sender_session->data_queue = data_item;
-				new_session->sender = new_sender_session;
-
-				int i;
-				for(i = 0; i < RUDP_WINDOW; i++) {
-					new_sender_session->retransmission_attempts[i] = 0;
-					new_sender_session->data_timeout_arg[i] = 0;
-					new_sender_session->sliding_window[i] = NULL;
-				}
-				new_sender_session->syn_retransmit_attempts=0;
-				new_sender_session->fin_retransmit_attempts=0;
-				seq_no=new_sender_session->seqNo;
-				temp->sessions_list_head=new_session;
-			}
-			else {
-				int sessionFound = 0;
-				// Check if we already have a session for this peer
-				struct session *temp2 = temp->sessions_list_head;
-				struct session *last_in_list;
-				while(temp2 != NULL) {
-					if(temp2->address->sin_addr.s_addr == to->sin_addr.s_addr && temp2->address->sin_port == to->sin_port && temp2->address->sin_family == to->sin_family)
-					{
-						// If the window has any free slots and the data queue is empty and the state is OPEN, we will send the packet
-						int data_is_queued = 0;
-						int we_must_queue = 1;
-
-						if(temp2->sender==NULL)
-						{
-							struct sender_session *new_sender_session=malloc(sizeof(struct sender_session));
-							new_sender_session->data_queue=NULL;
-							new_sender_session->fin_retransmit_attempts=0;
-							new_sender_session->status=SYN_SENT;
-							new_sender_session->seqNo = rand();
-							new_sender_session->sessionFinished=0;
-							//Creating a new session and adding the data to the queue
-							new_sender_session->data_queue = data_item;
-
-							int i;
-							for(i = 0; i < RUDP_WINDOW; i++) {
-								new_sender_session->retransmission_attempts[i] = 0;
-								new_sender_session->data_timeout_arg[i] = 0;
-								new_sender_session->sliding_window[i] = NULL;
-							}
-							new_sender_session->syn_retransmit_attempts=0;
-							new_sender_session->fin_retransmit_attempts=0;
-							seq_no=new_sender_session->seqNo;
-							temp2->sender=malloc(sizeof(struct sender_session));
-							temp2->sender = new_sender_session;
-							struct rudp_hdr *syn=malloc(sizeof(struct rudp_hdr));
-							syn->type=RUDP_SYN;
-							syn->version=RUDP_VERSION;
-							syn->seqno=seq_no;
-							struct rudp_packet *p = malloc(sizeof(struct rudp_packet));
-							p->header = *syn;
-							p->payload_length = 0;
-							send_packet(0, rsocket, p, to,0);
-							new_session_created = 0;//Dont send the SYN twice
-							break;
-						}
-
-
-
-						if(temp2->sender->data_queue != NULL)
-							data_is_queued = 1;
-
-						if(temp2->sender->status == OPEN && data_is_queued==0) {
-							int i;
-							for(i = 0; i < RUDP_WINDOW; i++) {
-								if(temp2->sender->sliding_window[i] == NULL) {
-									struct rudp_hdr *datah=malloc(sizeof(struct rudp_hdr));
-									datah->type=RUDP_DATA;
-									datah->version=RUDP_VERSION;
-									temp2->sender->seqNo = (temp2->sender->seqNo + (u_int32_t)1);
-									datah->seqno=temp2->sender->seqNo;
-									struct rudp_packet *datap=malloc(sizeof(struct rudp_packet));
-									bcopy(datah,&datap->header,sizeof(struct rudp_hdr));
-									bcopy(&len, &datap->payload_length, sizeof(int));
-									bcopy(data, &datap->payload, len);
-									temp2->sender->sliding_window[i]=datap;
-									temp2->sender->retransmission_attempts[i]=0;
-									send_packet(0,rsocket,datap,to,0);
-									we_must_queue = 0;
-									break;
-								}
-							}
-						}
-
-						if(we_must_queue == 1) {
-							// If so, queue the data
-							if(temp2->sender->data_queue == NULL) {
-								// First entry in the data queue
-								temp2->sender->data_queue = data_item;
-							}
-							else {
-								// Add to end of data queue
-								struct data *temp3 = temp2->sender->data_queue;
-								while(temp3->next != NULL) {
-									temp3 = temp3->next;
-								}
-								temp3->next = data_item;
-							}
-						}
-
-						sessionFound = 1;
-						new_session_created=0;
-						break;
-					}
-					if(temp2->next==NULL)
-						last_in_list=temp2;
-					temp2 = temp2->next;
-				}
-				if(sessionFound == 0) {
-					// If not, create a new session and send a SYN
-					struct session *new_session = malloc(sizeof(struct session));
-					new_session->address = to;
-					new_session->next = NULL;
-					new_session->receiver = NULL;
-					new_session->sender = malloc(sizeof(struct sender_session));
-					struct sender_session *new_sender_session = malloc(sizeof(struct sender_session));
-					new_sender_session->status=SYN_SENT;
-					new_sender_session->seqNo = rand();
-					new_sender_session->sessionFinished=0;
-					//Creating a new session and adding the data to the queue
-					new_sender_session->data_queue = data_item;
-					new_session->sender = new_sender_session;
-
-					int i;
-					for(i = 0; i < RUDP_WINDOW; i++) {
-						new_sender_session->retransmission_attempts[i] = 0;
-						new_sender_session->data_timeout_arg[i] = 0;
-						new_sender_session->sliding_window[i] = NULL;
-					}
-					new_sender_session->syn_retransmit_attempts=0;
-					new_sender_session->fin_retransmit_attempts=0;
-					seq_no=new_sender_session->seqNo;
-
-					//Added to rear of the session list
-					last_in_list->next=new_session;
-				}
-			}
+		temp->window = value;
+		return 0;
+	case RUDP_OPT_RTO_MIN:
+		if(value < 1 || value > temp->rto_max) {
+			fprintf(stderr, "rudp_setsockopt failed: minimum timeout must be between 1 and %d ms\n", temp->rto_max);
+			return -1;
 		}
-		else {
-			fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		temp->rto_min = value;
+		return 0;
+	case RUDP_OPT_RTO_MAX:
+		if(value < temp->rto_min) {
+			fprintf(stderr, "rudp_setsockopt failed: maximum timeout must be at least %d ms\n", temp->rto_min);
 			return -1;
 		}
+		temp->rto_max = value;
+		return 0;
+	case RUDP_OPT_CC:
+		if(value != RUDP_CC_NONE && value != RUDP_CC_RENO && value != RUDP_CC_BBR) {
+			fprintf(stderr, "rudp_setsockopt failed: unknown congestion control algorithm %d\n", value);
+			return -1;
+		}
+		temp->cc = value;
+		return 0;
+	case RUDP_OPT_ACK_EVERY:
+		if(value < 1 || value > RUDP_MAXWINDOW) {
+			fprintf(stderr, "rudp_setsockopt failed: ACK interval must be between 1 and %d packets\n", RUDP_MAXWINDOW);
+			return -1;
+		}
+		temp->ack_every = value;
+		return 0;
+	case RUDP_OPT_ACK_DELAY:
+		if(value < 1 || value > RUDP_MAXACKDELAY) {
+			fprintf(stderr, "rudp_setsockopt failed: ACK delay must be between 1 and %d ms\n", RUDP_MAXACKDELAY);
+			return -1;
+		}
+		temp->ack_delay = value;
+		return 0;
+	case RUDP_OPT_RECV_LOAN:
+		temp->recv_loan = value != 0;
+		return 0;
+	case RUDP_OPT_STREAM_DELAY:
+		if(value < 0 || value > RUDP_MAXSTREAMDELAY) {
+			fprintf(stderr, "rudp_setsockopt failed: Stream delay must be between 0 and %d ms\n", RUDP_MAXSTREAMDELAY);
+			return -1;
+		}
+		temp->stream_delay = value;
+		return 0;
+	case RUDP_OPT_SNDBUF:
+		if(value < 0) {
+			fprintf(stderr, "rudp_setsockopt failed: Send buffer size must not be negative\n");
+			return -1;
+		}
+		temp->sndbuf = value;
+		return 0;
+	case RUDP_OPT_LOSS:
+		if(value < 0 || value > 100) {
+			fprintf(stderr, "rudp_setsockopt failed: Loss must be between 0 and 100 percent\n");
+			return -1;
+		}
+		temp->loss = value;
+		return 0;
+	case RUDP_OPT_MSS:
+		if(value < RUDP_MINMSS || value > RUDP_MAXMSS) {
+			fprintf(stderr, "rudp_setsockopt failed: MSS must be between %d and %d bytes\n", RUDP_MINMSS, RUDP_MAXMSS);
+			return -1;
+		}
+		// The packets and payloads in the pools are made for the MSS
+		if(temp->packets.allocated > 0 || temp->shared.allocated > 0) {
+			fprintf(stderr, "rudp_setsockopt failed: MSS must be set before the socket is used\n");
+			return -1;
+		}
+		pool_destroy(&temp->packets);
+		pool_init(&temp->packets, sizeof(struct rudp_packet) + value);
+		pool_destroy(&temp->shared);
+		pool_init(&temp->shared, sizeof(struct rudp_shared) + value);
+		temp->mss = value;
+		return 0;
+	case RUDP_OPT_PMTUD:
+#ifdef IP_MTU_DISCOVER
+		{
+			// Set DF, but leave finding the path MTU to our probes
+			int pmtudisc = value ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+			if(setsockopt(temp->fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtudisc, sizeof(pmtudisc)) < 0) {
+				perror("rudp_setsockopt: IP_MTU_DISCOVER");
+				return -1;
+			}
+		}
+#endif
+		temp->pmtud = value != 0;
+		return 0;
+	}
+	fprintf(stderr, "rudp_setsockopt failed: unknown option %d\n", option);
+	return -1;
+}
+
+/*
+ * rudp_getsockopt: Get the value of a socket option
+ */
+int rudp_getsockopt(rudp_socket_t rsocket, rudp_option_t option, int *value) {
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL || value == NULL) {
+		fprintf(stderr, "rudp_getsockopt failed: invalid argument\n");
+		return -1;
+	}
+
+	switch(option) {
+	case RUDP_OPT_WINDOW:
+		*value = temp->window;
+		return 0;
+	case RUDP_OPT_RTO_MIN:
+		*value = temp->rto_min;
+		return 0;
+	case RUDP_OPT_RTO_MAX:
+		*value = temp->rto_max;
+		return 0;
+	case RUDP_OPT_CC:
+		*value = temp->cc;
+		return 0;
+	case RUDP_OPT_ACK_EVERY:
+		*value = temp->ack_every;
+		return 0;
+	case RUDP_OPT_ACK_DELAY:
+		*value = temp->ack_delay;
+		return 0;
+	case RUDP_OPT_RECV_LOAN:
+		*value = temp->recv_loan;
+		return 0;
+	case RUDP_OPT_STREAM_DELAY:
+		*value = temp->stream_delay;
+		return 0;
+	case RUDP_OPT_SNDBUF:
+		*value = temp->sndbuf;
+		return 0;
+	case RUDP_OPT_LOSS:
+		*value = temp->loss;
+		return 0;
+	case RUDP_OPT_MSS:
+		*value = temp->mss;
+		return 0;
+	case RUDP_OPT_PMTUD:
+		*value = temp->pmtud;
+		return 0;
+	}
+	fprintf(stderr, "rudp_getsockopt failed: unknown option %d\n", option);
+	return -1;
+}
+
+/*
+ * rudp_getinfo: Get the state of the session we send to peer on
+ */
+int rudp_getinfo(rudp_socket_t rsocket, struct sockaddr_in *peer, struct rudp_info *info) {
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL || peer == NULL || info == NULL) {
+		fprintf(stderr, "rudp_getinfo failed: invalid argument\n");
+		return -1;
+	}
+
+	struct session *temp2 = find_session(temp, peer);
+	if(temp2 == NULL || temp2->sender == NULL) {
+		// No data has been sent to this peer
+		return -1;
+	}
+
+	info->window = temp2->sender->window_size;
+	info->in_flight = temp2->sender->in_flight;
+	info->srtt = temp2->sender->srtt;
+	info->rttvar = temp2->sender->rttvar;
+	info->rto = temp2->sender->rto;
+	info->cwnd = rudp_cc_window(&temp2->sender->cc);
+	info->mss = temp2->sender->mss;
+	return 0;
+}
+
+
+/* 
+ * rudp_sendto: Send a block of data to the receiver. 
+ */
+
+int rudp_sendto(rudp_socket_t rsocket, void* data, int len, struct sockaddr_in* to) {
+
+	if(to == NULL) {
+		fprintf(stderr, "rudp_sendto Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	if(len < 0 || len > temp->mss) {
+		fprintf(stderr, "rudp_sendto Error: Attempting to send with invalid max packet size\n");
+		return -1;
+	}
+	if(send_blocked(temp, to))
+		return -1;
+
+	struct rudp_packet *data_item = packet_get(temp);
+	if(data_item == NULL)
+		return -1;
+	bcopy(data,data_item->payload,len);
+	data_item->payload_length = len;
+	data_item->iovcnt = 0;
+	data_item->header.flags = RUDP_FLAG_FIRST | RUDP_FLAG_LAST;
+	return queue_data(temp, data_item, to);
+}
+
+/*
+ * rudp_send_message: Send a message that may be larger than a packet. It
+ * is split into full packets, which are all taken from the pool before
+ * the first is queued, so that the message is sent whole or not at all.
+ */
+int rudp_send_message(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to) {
+	struct rudp_packet *first = NULL, *last = NULL;
+	int offset = 0, mss;
+
+	if(len < 0 || len > RUDP_MAXMSGSIZE) {
+		fprintf(stderr, "rudp_send_message Error: Attempting to send with invalid message size\n");
+		return -1;
+	}
+
+	if(to == NULL) {
+		fprintf(stderr, "rudp_send_message Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	if(send_blocked(temp, to))
+		return -1;
+
+	// Packets of the size the session sends, once it has been set up
+	struct session *session = find_session(temp, to);
+	if(session != NULL && session->sender != NULL && session->sender->status == OPEN)
+		mss = session->sender->mss;
+	else
+		mss = temp->mss;
+
+	do {
+		struct rudp_packet *data_item = packet_get(temp);
+		if(data_item == NULL) {
+			while(first != NULL) {
+				data_item = first;
+				first = first->next;
+				pool_put(&temp->packets, data_item);
+			}
+			return -1;
+		}
+		data_item->payload_length = len - offset < mss ? len - offset : mss;
+		bcopy((char *)data + offset, data_item->payload, data_item->payload_length);
+		data_item->iovcnt = 0;
+		data_item->header.flags = offset == 0 ? RUDP_FLAG_FIRST : 0;
+		offset += data_item->payload_length;
+		if(offset == len)
+			data_item->header.flags |= RUDP_FLAG_LAST;
+		data_item->next = NULL;
+		if(last == NULL)
+			first = data_item;
+		else
+			last->next = data_item;
+		last = data_item;
+	} while(offset < len);
+
+	while(first != NULL) {
+		struct rudp_packet *data_item = first;
+		first = first->next;
+		if(queue_data(temp, data_item, to) < 0) {
+			while(first != NULL) {
+				data_item = first;
+				first = first->next;
+				pool_put(&temp->packets, data_item);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * rudp_sendv: Send a block of data held in iovcnt buffers, without copying
+ * it. The buffers belong to RUDP until the sent handler has been called
+ * with cookie.
+ */
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt, struct sockaddr_in *to, void *cookie) {
+	int i, len = 0;
+
+	if(iov == NULL || iovcnt < 1 || iovcnt > RUDP_MAXIOV) {
+		fprintf(stderr, "rudp_sendv Error: Attempting to send with invalid number of buffers\n");
+		return -1;
+	}
+	if(to == NULL) {
+		fprintf(stderr, "rudp_sendv Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if(len > temp->mss) {
+		fprintf(stderr, "rudp_sendv Error: Attempting to send with invalid max packet size\n");
+		return -1;
+	}
+	if(send_blocked(temp, to))
+		return -1;
+
+	struct rudp_packet *data_item = packet_ref(temp);
+	if(data_item == NULL)
+		return -1;
+	for(i = 0; i < iovcnt; i++)
+		data_item->iov[i] = iov[i];
+	data_item->iovcnt = iovcnt;
+	data_item->payload_length = len;
+	data_item->header.flags = RUDP_FLAG_FIRST | RUDP_FLAG_LAST;
+	data_item->cookie = cookie;
+	return queue_data(temp, data_item, to);
+}
+
+/*
+ * rudp_sendto_group: Send a block of data to npeers peers. It is copied
+ * once, into a buffer that the packets of all of them refer to, and each
+ * session acknowledges and retransmits its packet on its own. If the send
+ * buffer of any of the peers is full, it is sent to none of them.
+ */
+int rudp_sendto_group(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to, int npeers) {
+	int i, blocked = 0, ret = 0;
+
+	if(to == NULL || npeers < 1) {
+		fprintf(stderr, "rudp_sendto_group Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	if(len < 0 || len > temp->mss) {
+		fprintf(stderr, "rudp_sendto_group Error: Attempting to send with invalid max packet size\n");
+		return -1;
+	}
+	if(temp->group.sin_family != 0 && open_group(temp, len, to, npeers) < 0)
+		return -1;
+	// Every blocked peer is told when it is writable again
+	for(i = 0; i < npeers; i++)
+		blocked |= send_blocked(temp, &to[i]);
+	if(blocked) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	struct rudp_shared *shared = pool_get(&temp->shared);
+	if(shared == NULL)
+		return -1;
+	bcopy(data, shared->data, len);
+	shared->refs = 1;
+
+	for(i = 0; i < npeers; i++) {
+		struct rudp_packet *data_item = packet_ref(temp);
+		if(data_item == NULL) {
+			ret = -1;
+			break;
+		}
+		data_item->iov[0].iov_base = shared->data;
+		data_item->iov[0].iov_len = len;
+		data_item->iovcnt = 1;
+		data_item->payload_length = len;
+		data_item->header.flags = RUDP_FLAG_FIRST | RUDP_FLAG_LAST;
+		data_item->shared = shared;
+		shared->refs++;
+		temp->group_sending = temp->group.sin_family != 0;
+		if(queue_data(temp, data_item, &to[i]) < 0) {
+			shared->refs--;
+			ret = -1;
+			break;
+		}
+	}
+	temp->group_sending = 0;
+	if(--shared->refs == 0)
+		pool_put(&temp->shared, shared);
+	return ret;
+}
+
+/*
+ * open_group: Check that the peers of rudp_sendto_group on a socket that
+ * sends to a multicast group are its members, which get the same packets
+ * with the same seqnos. The first call opens a session with each of its
+ * peers, and they become the members.
+ */
+int open_group(struct sockets *temp, int len, struct sockaddr_in *to, int npeers) {
+	struct session *session;
+	int i;
+
+	// Packets to the group are not split for a member
+	if(len > RUDP_MAXPKTSIZE) {
+		fprintf(stderr, "rudp_sendto_group Error: Packets to a multicast group hold at most %d bytes\n", RUDP_MAXPKTSIZE);
+		return -1;
+	}
+
+	if(temp->members == 0) {
+		for(i = 0; i < npeers; i++) {
+			session = find_session(temp, &to[i]);
+			if(session != NULL && session->sender != NULL) {
+				fprintf(stderr, "rudp_sendto_group Error: A member of the multicast group has been sent to already\n");
+				return -1;
+			}
+		}
+		temp->group_opening = 1;
+		for(i = 0; i < npeers; i++) {
+			if((session = open_sender(temp, &to[i])) == NULL)
+				break;
+			if(!session->sender->member) {
+				session->sender->member = 1;
+				temp->members++;
+			}
+		}
+		temp->group_opening = 0;
+		return i < npeers ? -1 : 0;
+	}
+
+	for(i = 0; i < npeers; i++) {
+		session = find_session(temp, &to[i]);
+		if(session == NULL || session->sender == NULL || !session->sender->member)
+			break;
+	}
+	if(i < npeers || npeers != temp->members) {
+		fprintf(stderr, "rudp_sendto_group Error: The peers are not the members of the multicast group\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * rudp_multicast: Send the DATA of rudp_sendto_group to a multicast group
+ * from now on, out of the interface with address ifaddr, or the one the
+ * routing table picks if it is NULL. That fails on a host with no route
+ * for the group, such as one without a default route. The peers of the
+ * first rudp_sendto_group call become the members of the group.
+ */
+int rudp_multicast(rudp_socket_t rsocket, struct sockaddr_in *group, struct in_addr *ifaddr) {
+	if(group == NULL || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+		fprintf(stderr, "rudp_multicast Error: Not a multicast address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_multicast failed: invalid socket\n");
+		return -1;
+	}
+	if(temp->group.sin_family != 0) {
+		fprintf(stderr, "rudp_multicast failed: The socket already sends to a group\n");
+		return -1;
+	}
+
+	if(ifaddr != NULL && setsockopt(temp->fd, IPPROTO_IP, IP_MULTICAST_IF, ifaddr, sizeof(*ifaddr)) < 0) {
+		perror("rudp_multicast: setsockopt IP_MULTICAST_IF");
+		return -1;
+	}
+	// Without an interface, find out now rather than on every send to the
+	// group if there is no route for it. Connecting a UDP socket sends
+	// nothing.
+	if(ifaddr == NULL) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(fd >= 0 && connect(fd, (struct sockaddr *)group, sizeof(*group)) < 0 && errno == ENETUNREACH) {
+			fprintf(stderr, "rudp_multicast failed: No route to the group, give the address of an interface\n");
+			close(fd);
+			return -1;
+		}
+		if(fd >= 0)
+			close(fd);
+	}
+	// Receivers on this host get the group's packets too
+	unsigned char loop = 1;
+	if(setsockopt(temp->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+		perror("rudp_multicast: setsockopt IP_MULTICAST_LOOP");
+		return -1;
+	}
+	temp->group = *group;
+	temp->group.sin_family = AF_INET;
+	temp->group_seq = rudp_random();
+	return 0;
+}
+
+/*
+ * rudp_join_group: Receive the DATA that is sent to a multicast group on
+ * the interface with address ifaddr, or the one the routing table picks
+ * if it is NULL, which fails on a host with no route for the group. It
+ * is read from a second UDP socket, bound to the group's port, which any
+ * number of RUDP sockets on the host may share; the ACKs are sent from
+ * the RUDP socket as usual.
+ */
+int rudp_join_group(rudp_socket_t rsocket, struct sockaddr_in *group, struct in_addr *ifaddr) {
+	struct ip_mreq mreq;
+	int fd, on = 1;
+
+	if(group == NULL || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+		fprintf(stderr, "rudp_join_group Error: Not a multicast address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_join_group failed: invalid socket\n");
+		return -1;
+	}
+	if(temp->group_fd >= 0) {
+		fprintf(stderr, "rudp_join_group failed: The socket has already joined a group\n");
+		return -1;
+	}
+
+	if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("rudp_join_group: socket");
+		return -1;
+	}
+	struct sockaddr_in address = *group;
+	address.sin_family = AF_INET;
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+	   bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror("rudp_join_group: bind");
+		close(fd);
+		return -1;
+	}
+	mreq.imr_multiaddr = group->sin_addr;
+	mreq.imr_interface.s_addr = ifaddr != NULL ? ifaddr->s_addr : htonl(INADDR_ANY);
+	if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		if(ifaddr == NULL && errno == ENODEV)
+			fprintf(stderr, "rudp_join_group failed: No route to the group, give the address of an interface\n");
+		else
+			perror("rudp_join_group: setsockopt IP_ADD_MEMBERSHIP");
+		close(fd);
+		return -1;
+	}
+	if(event_fd(fd, groupCallback, temp, "groupCallback") < 0) {
+		fprintf(stderr, "Error registering group callback function");
+		close(fd);
+		return -1;
+	}
+	temp->group_fd = fd;
+	return 0;
+}
+
+/*
+ * rudp_write: Append data to the stream to a peer. It is copied into the
+ * packet being filled, which is queued once it holds the MSS of the
+ * session, and otherwise when stream_delay has passed or on rudp_flush.
+ */
+int rudp_write(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to) {
+	if(len < 0 || data == NULL) {
+		fprintf(stderr, "rudp_write Error: Attempting to write invalid data\n");
+		return -1;
+	}
+	if(to == NULL) {
+		fprintf(stderr, "rudp_write Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	if(send_blocked(temp, to))
+		return -1;
+	struct session *temp2 = open_sender(temp, to);
+	if(temp2 == NULL)
+		return -1;
+	struct sender_session *sender = temp2->sender;
+
+	while(len > 0) {
+		struct rudp_packet *p = sender->stream;
+		if(p == NULL) {
+			if((p = sender->stream = packet_get(temp)) == NULL)
+				return -1;
+			// Every packet of a stream stands alone for the receiver
+			p->header.flags = RUDP_FLAG_FIRST | RUDP_FLAG_LAST;
+			p->payload_length = 0;
+			p->iovcnt = 0;
+		}
+		int n = sender->mss - p->payload_length;
+		if(n > len)
+			n = len;
+		if(n > 0) {
+			bcopy(data, p->payload + p->payload_length, n);
+			p->payload_length += n;
+			data = (char *)data + n;
+			len -= n;
+		}
+		if(p->payload_length >= sender->mss)
+			flush_stream(temp, temp2);
+	}
+
+	if(sender->stream != NULL) {
+		if(temp->stream_delay == 0)
+			flush_stream(temp, temp2);
+		else if(sender->stream_timer == EVENT_TIMER_NONE) {
+			struct timeval now, delay, when;
+			gettimeofday(&now, NULL);
+			delay.tv_sec = temp->stream_delay / 1000;
+			delay.tv_usec = (temp->stream_delay % 1000) * 1000;
+			timeradd(&now, &delay, &when);
+			sender->stream_timer = event_timer(when, streamTimeoutCallback, sender, "streamTimeoutCallback");
+		}
+	}
+	return 0;
+}
+
+/*
+ * rudp_flush: Send the data of rudp_write to a peer that is held back.
+ */
+int rudp_flush(rudp_socket_t rsocket, struct sockaddr_in *to) {
+	if(to == NULL) {
+		fprintf(stderr, "rudp_flush Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = find_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid socket. Socket not found\n");
+		return -1;
+	}
+
+	struct session *temp2 = find_session(temp, to);
+	if(temp2 != NULL)
+		flush_stream(temp, temp2);
+	return 0;
+}
+
+/*
+ * flush_stream: Queue the packet of a session that rudp_write is filling.
+ */
+void flush_stream(struct sockets *socket, struct session *session) {
+	struct sender_session *sender = session->sender;
+	if(sender == NULL || sender->stream == NULL)
+		return;
+	event_timer_cancel(sender->stream_timer);
+	sender->stream_timer = EVENT_TIMER_NONE;
+	struct rudp_packet *p = sender->stream;
+	sender->stream = NULL;
+	append_data(socket, session, p);
+}
+
+int streamTimeoutCallback(int fd, void *arg) {
+	struct sender_session *sender = arg;
+	sender->stream_timer = EVENT_TIMER_NONE;
+	struct session *session = find_session(sender->socket, sender->peer);
+	if(session != NULL)
+		flush_stream(sender->socket, session);
+	return 0;
+}
+
+/*
+ * rudp_submit_sendto: Send a datagram from any thread. It is copied and
+ * queued for the loop of the socket, which sends it with rudp_sendto.
+ * Fails with EAGAIN while RUDP_OPT_SNDBUF requests are waiting, which
+ * they do while a send buffer is full.
+ */
+int rudp_submit_sendto(rudp_socket_t rsocket, void *data, int len, struct sockaddr_in *to) {
+	if(to == NULL) {
+		fprintf(stderr, "rudp_submit_sendto Error: Attempting to send to an invalid address\n");
+		return -1;
+	}
+
+	struct sockets *temp = hold_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "Error: Attempt to send on invalid or closed socket\n");
+		return -1;
+	}
+
+	if(len < 0 || len > temp->mss) {
+		release_socket(rsocket);
+		fprintf(stderr, "rudp_submit_sendto Error: Attempting to send with invalid max packet size\n");
+		return -1;
+	}
+
+	// Counted per peer, so that a peer whose send buffer is full does not
+	// hold back the others, unless they hash alike
+	int *submitted = &temp->submitted[session_hash(to) & (RUDP_SUBMIT_BUCKETS - 1)];
+	int waiting = __atomic_fetch_add(submitted, 1, __ATOMIC_RELAXED);
+	if(temp->sndbuf > 0 && waiting >= temp->sndbuf) {
+		__atomic_fetch_sub(submitted, 1, __ATOMIC_RELAXED);
+		release_socket(rsocket);
+		errno = EAGAIN;
+		return -1;
+	}
+	struct rudp_request *request = malloc(sizeof(struct rudp_request) + len);
+	if(request == NULL) {
+		__atomic_fetch_sub(submitted, 1, __ATOMIC_RELAXED);
+		release_socket(rsocket);
+		perror("rudp_submit_sendto: malloc");
+		return -1;
+	}
+	request->close = 0;
+	request->to = *to;
+	request->len = len;
+	bcopy(data, request->data, len);
+	int ret = submit_request(temp, request);
+	release_socket(rsocket);
+	return ret;
+}
+
+/*
+ * rudp_submit_close: Close a socket from any thread, after the requests
+ * that were submitted before. Requests submitted after it fail.
+ */
+int rudp_submit_close(rudp_socket_t rsocket) {
+	struct sockets *temp = hold_socket(rsocket);
+	if(temp == NULL) {
+		fprintf(stderr, "rudp_submit_close failed: invalid or closed socket\n");
+		return -1;
+	}
+
+	struct rudp_request *request = malloc(sizeof(struct rudp_request));
+	if(request == NULL) {
+		release_socket(rsocket);
+		perror("rudp_submit_close: malloc");
+		return -1;
+	}
+	if(__atomic_exchange_n(&temp->submit_closed, 1, __ATOMIC_SEQ_CST)) {
+		release_socket(rsocket);
+		free(request);
+		fprintf(stderr, "rudp_submit_close failed: invalid or closed socket\n");
+		return -1;
+	}
+	request->close = 1;
+	request->len = 0;
+	int ret = submit_request(temp, request);
+	release_socket(rsocket);
+	return ret;
+}
+
+/*
+ * submit_request: Push a request on the queue of a socket, without a lock,
+ * and wake its loop unless that has been done since it last took the
+ * requests, so that a burst of requests costs one system call.
+ */
+int submit_request(struct sockets *socket, struct rudp_request *request) {
+	request->next = __atomic_load_n(&socket->submit_head, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&socket->submit_head, &request->next, request, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	if(!__atomic_exchange_n(&socket->submit_signalled, 1, __ATOMIC_SEQ_CST)) {
+		u_int64_t one = 1;
+		if(write(socket->submit_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+			perror("rudp_submit: write");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Callback function executed when other threads have submitted requests.
+ * Takes all of them at once and carries them out in the order they were
+ * submitted, sending the packets together as receiveCallback does.
+ */
+int submitCallback(int fd, void *arg) {
+	struct sockets *socket = arg;
+	u_int64_t count;
+
+	while(read(fd, &count, sizeof(count)) > 0)
+		;
+	__atomic_store_n(&socket->submit_signalled, 0, __ATOMIC_SEQ_CST);
+	struct rudp_request *request = __atomic_exchange_n(&socket->submit_head, NULL, __ATOMIC_SEQ_CST);
+	if(request == NULL)
+		return 0;
+
+	// The queue is newest first
+	struct rudp_request *first = NULL, *last = request;
+	while(request != NULL) {
+		struct rudp_request *next = request->next;
+		request->next = first;
+		first = request;
+		request = next;
+	}
+	if(socket->backlog == NULL)
+		socket->backlog = first;
+	else
+		socket->backlog_tail->next = first;
+	socket->backlog_tail = last;
+
+	socket->io->deferring = 1;
+	run_requests(socket);
+	socket->io->deferring = 0;
+	flush_sends(socket);
+	complete_packets(socket);
+	return 0;
+}
+
+/*
+ * run_requests: Carry out the requests taken from the queue. A send that
+ * finds the send buffer of its session full stays in the queue until
+ * RUDP_EVENT_WRITABLE, and so do the later sends to the same peer, which
+ * find it full too; the sends to other peers go on. A close waits for
+ * every request before it.
+ */
+void run_requests(struct sockets *socket) {
+	struct rudp_request *request, *prev = NULL;
+	while((request = prev == NULL ? socket->backlog : prev->next) != NULL) {
+		if(request->close) {
+			if(prev != NULL)
+				break;
+			rudp_close(socket->rsock);
+		}
+		else if(rudp_sendto(socket->rsock, request->data, request->len, &request->to) < 0 && errno == EAGAIN) {
+			prev = request;
+			continue;
+		}
+		else
+			__atomic_fetch_sub(&socket->submitted[session_hash(&request->to) & (RUDP_SUBMIT_BUCKETS - 1)], 1, __ATOMIC_RELAXED);
+		if(prev == NULL)
+			socket->backlog = request->next;
+		else
+			prev->next = request->next;
+		if(socket->backlog_tail == request)
+			socket->backlog_tail = prev;
+		free(request);
+	}
+}
+
+/*
+ * send_blocked: Check if the send buffer of the session with a peer is
+ * full. If it is, errno is set to EAGAIN, and RUDP_EVENT_WRITABLE is
+ * fired once it has been half emptied.
+ */
+int send_blocked(struct sockets *socket, struct sockaddr_in *to) {
+	struct session *session = find_session(socket, to);
+	if(socket->sndbuf == 0 || session == NULL || session->sender == NULL || session->sender->queued < socket->sndbuf)
+		return 0;
+	session->sender->blocked = 1;
+	errno = EAGAIN;
+	return 1;
+}
+
+/*
+ * check_writable: Tell the application that it may send to a peer again,
+ * after data has left the queue of the session.
+ */
+void check_writable(struct sockets *socket, struct session *session) {
+	struct sender_session *sender = session->sender;
+	if(!sender->blocked || sender->queued > socket->sndbuf / 2)
+		return;
+	sender->blocked = 0;
+	if(socket->backlog != NULL)
+		run_requests(socket);
+	if(socket->handler != NULL)
+		socket->handler(socket->rsock, RUDP_EVENT_WRITABLE, session->address);
+}
+
+/*
+ * queue_data: Queue a DATA packet for a peer, and send it if the window
+ * allows. If this fails, the packet is returned to the pool.
+ */
+int queue_data(struct sockets *temp, struct rudp_packet *data_item, struct sockaddr_in *to) {
+	struct session *temp2 = open_sender(temp, to);
+	if(temp2 == NULL) {
+		packet_put(temp, data_item);
+		return -1;
+	}
+	append_data(temp, temp2, data_item);
+	return 0;
+}
+
+/*
+ * open_sender: Find the session with a peer that has a sender session.
+ * If there is none yet, one is created and sends a SYN.
+ */
+struct session *open_sender(struct sockets *temp, struct sockaddr_in *to) {
+	// Check if we already have a session for this peer, if not, create one
+	struct session *temp2 = find_session(temp, to);
+	if(temp2 == NULL)
+		temp2 = new_session(temp, to);
+	if(temp2 == NULL)
+		return NULL;
+
+	// Members of a multicast group must be sent the same packets
+	if(temp2->sender != NULL && temp2->sender->member && !temp->group_sending) {
+		fprintf(stderr, "Error: Attempt to send to a member of a multicast group alone\n");
+		return NULL;
+	}
+
+	if(temp2->sender == NULL) {
+		// No sender session with this peer yet: send a SYN, data is queued until it is ACKed
+		temp2->sender = new_sender_session(temp, temp2->address);
+
+		struct rudp_packet syn;
+		syn.header.type=RUDP_SYN;
+		syn.header.version=RUDP_VERSION;
+		syn.header.flags=0;
+		syn.header.seqno=temp2->sender->seqNo;
+		syn.payload_length = 0;
+		syn.payload = NULL;
+		syn.iovcnt = 0;
+		send_packet(0, temp, &syn, temp2->address, 0);
+	}
+	return temp2;
+}
+
+/*
+ * append_data: Add a DATA packet to the end of the queue of a session,
+ * and send it if the window allows.
+ */
+void append_data(struct sockets *temp, struct session *temp2, struct rudp_packet *data_item) {
+	data_item->next = NULL;
+
+	// Add to end of data queue
+	if(temp2->sender->data_queue == NULL)
+		temp2->sender->data_queue = data_item;
+	else
+		temp2->sender->data_tail->next = data_item;
+	temp2->sender->data_tail = data_item;
+	temp2->sender->queued++;
+
+	// Send it right away if the window has a free slot
+	if(temp2->sender->status == OPEN)
+		fill_window(temp, temp2);
+}
+
+int timeoutCallback(int fd, void *args) {
+	struct timeoutargs *timeargs=(struct timeoutargs*)args;
+	struct sockets *temp = timeargs->socket;
+	// Check if we already have a session for this peer
+	struct session *temp2 = find_session(temp, timeargs->recipient);
+	if(temp2 != NULL) {
+		// SYN and FIN are header only
+		struct rudp_packet control;
+		control.header = timeargs->header;
+		control.payload_length = 0;
+		control.payload = NULL;
+		control.iovcnt = 0;
+
+		if(timeargs->header.type==RUDP_SYN)
+		{
+			if(temp2->sender->syn_retransmit_attempts>=RUDP_MAXRETRANS)
+			{
+				RUDP_LOG(RUDP_LOG_INFO, RUDP_LOG_SESSION, RUDP_LOGEV_TIMEOUT, timeargs->header.type, timeargs->header.seqno, timeargs->recipient->sin_addr.s_addr, timeargs->recipient->sin_port, 0);
+				temp->handler(temp->rsock,RUDP_EVENT_TIMEOUT,timeargs->recipient);
+			}
+			else
+			{
+				temp2->sender->syn_retransmit_attempts++;
+				rto_backoff(temp2->sender, temp2->sender->rto);
+				send_packet(0,temp,&control,timeargs->recipient,1);
+			}
+		}
+		else if(timeargs->header.type==RUDP_FIN)
+		{
+			if(temp2->sender->fin_retransmit_attempts>=RUDP_MAXRETRANS)
+			{
+				RUDP_LOG(RUDP_LOG_INFO, RUDP_LOG_SESSION, RUDP_LOGEV_TIMEOUT, timeargs->header.type, timeargs->header.seqno, timeargs->recipient->sin_addr.s_addr, timeargs->recipient->sin_port, 0);
+				temp->handler(temp->rsock,RUDP_EVENT_TIMEOUT,timeargs->recipient);
+			}
+			else
+			{
+				temp2->sender->fin_retransmit_attempts++;
+				rto_backoff(temp2->sender, temp2->sender->rto);
+				send_packet(0,temp,&control,timeargs->recipient,1);
+			}
+		}
+		else{
+			struct window_slot *slot = window_slot(temp2->sender, timeargs->header.seqno);
+			if(slot == NULL || slot->acked) {
+				// The packet has been acknowledged since the timer was set
+			}
+			else if(slot->retransmission_attempts>=RUDP_MAXRETRANS)
+			{
+				RUDP_LOG(RUDP_LOG_INFO, RUDP_LOG_SESSION, RUDP_LOGEV_TIMEOUT, timeargs->header.type, timeargs->header.seqno, timeargs->recipient->sin_addr.s_addr, timeargs->recipient->sin_port, 0);
+				temp->handler(temp->rsock,RUDP_EVENT_TIMEOUT,timeargs->recipient);
+			}
+			else
+			{
+				slot->retransmission_attempts++;
+				if(rto_backoff(temp2->sender, slot->rto)) {
+					rudp_cc_timeout(&temp2->sender->cc, temp2->sender->in_flight);
+					temp2->sender->cc.in_recovery = 0;
+					temp2->sender->dupacks = 0;
+				}
+				resend_data(temp, temp2, slot);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int send_packet(int isAck, struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient,int retransmission) {
+	// Send packet on UDP socket
+	RUDP_LOG(RUDP_LOG_TRACE, RUDP_LOG_PACKET, retransmission ? RUDP_LOGEV_RESEND : RUDP_LOGEV_SEND, p->header.type, recipient->sin_addr.s_addr, recipient->sin_port, p->header.seqno, socket->fd);
+
+		if (socket->loss > 0 && rudp_random() % 100 < socket->loss) {
+			RUDP_LOG(RUDP_LOG_DEBUG, RUDP_LOG_PACKET, RUDP_LOGEV_DROP, p->header.type, recipient->sin_addr.s_addr, recipient->sin_port, p->header.seqno, 0);
+		}
+		else if(socket->io->deferring && p->header.type != RUDP_PROBE)
+		{
+			queue_send(socket, p, recipient);
+		}
+		else
+		{
+			// A PROBE is not held back, so that send_probe learns if it is too
+			// large for the interface. What is held back goes first.
+			if(socket->io->tx_count > 0)
+				flush_sends(socket);
+			// The payload is sent from where it is, without copying it
+			struct rudp_wirehdr wh;
+			struct iovec iov[RUDP_MAXIOV + 1];
+			struct msghdr msg;
+			bzero(&msg, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = packet_iov(p, &wh, iov);
+			msg.msg_name = recipient;
+			msg.msg_namelen = sizeof(struct sockaddr_in);
+			if (sendmsg(socket->fd, &msg, 0) < 0) {
+				if (errno != EMSGSIZE)
+					fprintf(stderr, "rudp_sendto: sendmsg failed\n");
+				return -1;
+			}
+		}
+
+	// Set a timeout event, unless the packet is an ACK
+	if(isAck == 0)
+		start_timer(socket, p, recipient);
+	return 0;
+}
+
+/*
+ * start_timer: Set the retransmission timer of a packet that has been
+ * sent to a peer. Its arguments are kept with the session, next to the
+ * timer handle.
+ */
+void start_timer(struct sockets *socket, struct rudp_packet *p, struct sockaddr_in *recipient) {
+	struct timeoutargs *timeargs = NULL;
+	event_timer_t *timer = NULL;
+	struct timeval currentTime;
+	gettimeofday(&currentTime, NULL);
+	long rto = RUDP_TIMEOUT * 1000L;
+	// Check if we already have a session for this peer
+	struct session *temp2 = find_session(socket, recipient);
+	if(temp2 != NULL) {
+		rto = temp2->sender->rto;
+
+		if(p->header.type==RUDP_SYN)
+		{
+			timeargs=&temp2->sender->syn_timeargs;
+			timeargs->packet=NULL;
+			timer=&temp2->sender->syn_timer;
+			temp2->sender->syn_sent_time=currentTime;
+		}
+		else if(p->header.type==RUDP_FIN)
+		{
+			timeargs=&temp2->sender->fin_timeargs;
+			timeargs->packet=NULL;
+			timer=&temp2->sender->fin_timer;
+		}
+		else if(p->header.type==RUDP_DATA)
+		{
+			struct window_slot *slot = window_slot(temp2->sender, p->header.seqno);
+			if(slot != NULL) {
+				timeargs=&slot->timeargs;
+				timeargs->packet=slot->packet;
+				timer=&slot->timer;
+				slot->sent_time=currentTime;
+				slot->rto=rto;
+			}
+		}
+		if(timeargs != NULL) {
+			timeargs->socket=socket;
+			timeargs->header=p->header;
+			timeargs->recipient=temp2->address;
+		}
+	}
+	if(timeargs != NULL) {
+		struct timeval delay;
+		delay.tv_sec = rto / 1000000;
+		delay.tv_usec = rto % 1000000;
+		struct timeval timeoutTime;
+		timeradd(&currentTime, &delay, &timeoutTime);
+		*timer = event_timer(timeoutTime, timeoutCallback, timeargs, "timeoutCallback");
+	}
+}
+
+/*
+ * ring_size: Smallest power of two that holds window entries.
+ */
+u_int32_t ring_size(int window) {
+	u_int32_t size = 1;
+	while(size < (u_int32_t)window)
+		size <<= 1;
+	return size;
+}
+
+/*
+ * new_receiver_session: Create a receiver session on socket for a peer
+ * whose SYN carried syn_seqno, buffering up to the socket's window of
+ * packets out of order.
+ */
+struct receiver_session *new_receiver_session(struct sockets *socket, struct sockaddr_in *peer, u_int32_t syn_seqno) {
+	int window = socket->window;
+	struct receiver_session *new_receiver_session = malloc(sizeof(struct receiver_session));
+	new_receiver_session->status = OPENING;
+	new_receiver_session->sessionFinished = 0;
+	new_receiver_session->expected_seqNo = (syn_seqno+(u_int32_t)1);
+	new_receiver_session->window_size = window;
+	new_receiver_session->window_mask = ring_size(window) - 1;
+	new_receiver_session->reorder_buffer = calloc(ring_size(window), sizeof(struct rudp_packet *));
+	new_receiver_session->buffered = 0;
+	new_receiver_session->highest_seqNo = syn_seqno;
+	new_receiver_session->packets = &socket->packets;
+	new_receiver_session->message = NULL;
+	new_receiver_session->message_size = 0;
+	// Holding back ACKs for more than half the window would stall the sender
+	new_receiver_session->ack_every = socket->ack_every < window / 2 ? socket->ack_every : window / 2;
+	if(new_receiver_session->ack_every < 1)
+		new_receiver_session->ack_every = 1;
+	new_receiver_session->ack_delay = socket->ack_delay * 1000L;
+	new_receiver_session->unacked = 0;
+	new_receiver_session->quickacks = 0;
+	new_receiver_session->ack_timer = EVENT_TIMER_NONE;
+	new_receiver_session->socket = socket;
+	new_receiver_session->peer = peer;
+	return new_receiver_session;
+}
+
+/*
+ * free_receiver_session: Free a receiver session and the packets in its
+ * reorder buffer.
+ */
+void free_receiver_session(struct receiver_session *receiver) {
+	u_int32_t i;
+	event_timer_cancel(receiver->ack_timer);
+	for(i = 0; i <= receiver->window_mask; i++)
+		pool_put(receiver->packets, receiver->reorder_buffer[i]);
+	free(receiver->reorder_buffer);
+	free(receiver->message);
+	free(receiver);
+}
+
+/*
+ * new_sender_session: Create a sender session using the window and
+ * timeout settings of socket. The SYN is sent with seqNo.
+ */
+struct sender_session *new_sender_session(struct sockets *socket, struct sockaddr_in *peer) {
+	int window = socket->window;
+	struct sender_session *new_sender_session = malloc(sizeof(struct sender_session));
+	new_sender_session->status = SYN_SENT;
+	// Members of a multicast group number their packets alike
+	new_sender_session->seqNo = socket->group_opening ? socket->group_seq : rudp_random();
+	new_sender_session->window_base = new_sender_session->seqNo + (u_int32_t)1;
+	new_sender_session->in_flight = 0;
+	new_sender_session->window_size = window;
+	new_sender_session->window_mask = ring_size(window) - 1;
+	new_sender_session->window = calloc(ring_size(window), sizeof(struct window_slot));
+	new_sender_session->data_queue = NULL;
+	new_sender_session->data_tail = NULL;
+	new_sender_session->queued = 0;
+	new_sender_session->blocked = 0;
+	new_sender_session->member = 0;
+	new_sender_session->socket = socket;
+	new_sender_session->peer = peer;
+	// Until the peer has told us what it accepts
+	new_sender_session->mss = socket->mss < RUDP_MAXPKTSIZE ? socket->mss : RUDP_MAXPKTSIZE;
+	new_sender_session->mss_max = new_sender_session->mss;
+	new_sender_session->probes = 0;
+	new_sender_session->probe_size = 0;
+	new_sender_session->probe_tries = 0;
+	new_sender_session->probe_seq = 0;
+	new_sender_session->probe_timer = EVENT_TIMER_NONE;
+	new_sender_session->stream = NULL;
+	new_sender_session->stream_timer = EVENT_TIMER_NONE;
+	new_sender_session->sessionFinished = 0;
+	new_sender_session->syn_timer = EVENT_TIMER_NONE;
+	new_sender_session->fin_timer = EVENT_TIMER_NONE;
+	new_sender_session->syn_retransmit_attempts = 0;
+	new_sender_session->fin_retransmit_attempts = 0;
+	new_sender_session->srtt = 0;
+	new_sender_session->rttvar = 0;
+	new_sender_session->rto_min = socket->rto_min * 1000L;
+	new_sender_session->rto_max = socket->rto_max * 1000L;
+	new_sender_session->rto = RUDP_TIMEOUT * 1000L;
+	if(new_sender_session->rto < new_sender_session->rto_min)
+		new_sender_session->rto = new_sender_session->rto_min;
+	if(new_sender_session->rto > new_sender_session->rto_max)
+		new_sender_session->rto = new_sender_session->rto_max;
+	rudp_cc_init(&new_sender_session->cc, socket->cc);
+	new_sender_session->dupacks = 0;
+	new_sender_session->recover = new_sender_session->seqNo;
+	return new_sender_session;
+}
+
+/*
+ * free_sender_session: Cancel the timers of a sender session and free it,
+ * with the packets in its window and queue.
+ */
+void free_sender_session(struct sender_session *sender) {
+	u_int32_t i;
+	event_timer_cancel(sender->syn_timer);
+	event_timer_cancel(sender->fin_timer);
+	event_timer_cancel(sender->probe_timer);
+	event_timer_cancel(sender->stream_timer);
+	pool_put(&sender->socket->packets, sender->stream);
+	for(i = 0; i <= sender->window_mask; i++) {
+		if(sender->window[i].packet != NULL) {
+			event_timer_cancel(sender->window[i].timer);
+			release_packet(sender->socket, sender->window[i].packet, 0);
+		}
+	}
+	while(sender->data_queue != NULL) {
+		struct rudp_packet *item = sender->data_queue;
+		sender->data_queue = item->next;
+		release_packet(sender->socket, item, 0);
+	}
+	if(sender->member)
+		sender->socket->members--;
+	free(sender->window);
+	free(sender);
+}
+
+/*
+ * add_socket: Put a new socket in a free slot of the socket table, and
+ * give it the handle of that slot.
+ */
+int add_socket(struct sockets *socket) {
+	int i;
+	pthread_mutex_lock(&socket_lock);
+	for(i = 0; i < socket_table_size; i++) {
+		if(SOCKET_SLOT(i)->socket == NULL)
+			break;
+	}
+	if(i == socket_table_size) {
+		if(socket_table_size == SOCKET_INDEX_MASK + 1) {
+			pthread_mutex_unlock(&socket_lock);
+			fprintf(stderr, "rudp_socket: Too many sockets\n");
+			return -1;
+		}
+		struct socket_slot *chunk = calloc(SOCKET_CHUNK, sizeof(struct socket_slot));
+		if(chunk == NULL) {
+			pthread_mutex_unlock(&socket_lock);
+			perror("rudp_socket: calloc");
+			return -1;
+		}
+		__atomic_store_n(&socket_table[i >> SOCKET_CHUNK_BITS], chunk, __ATOMIC_RELEASE);
+		socket_table_size += SOCKET_CHUNK;
+	}
+
+	struct socket_slot *slot = SOCKET_SLOT(i);
+	// Generation 0 in slot 0 would be a NULL handle
+	if((slot->generation << SOCKET_INDEX_BITS) == 0)
+		slot->generation = 1;
+	socket->rsock = (rudp_socket_t)((slot->generation << SOCKET_INDEX_BITS) | i);
+	__atomic_store_n(&slot->socket, socket, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&socket_lock);
+	return 0;
+}
+
+/*
+ * find_socket: Find the socket with handle rsocket, or NULL if there is
+ * none.
+ */
+struct sockets *find_socket(rudp_socket_t rsocket) {
+	uintptr_t i = (uintptr_t)rsocket & SOCKET_INDEX_MASK;
+	struct socket_slot *chunk = __atomic_load_n(&socket_table[i >> SOCKET_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	if(chunk == NULL)
+		return NULL;
+	struct sockets *socket = __atomic_load_n(&chunk[i & (SOCKET_CHUNK - 1)].socket, __ATOMIC_ACQUIRE);
+	if(socket == NULL || socket->rsock != rsocket)
+		return NULL;
+	return socket;
+}
+
+/*
+ * hold_socket: Find the socket with handle rsocket for a thread other
+ * than its loop's, and keep free_socket from freeing it until
+ * release_socket. NULL if there is none, or rudp_submit_close has been
+ * called on it.
+ */
+struct sockets *hold_socket(rudp_socket_t rsocket) {
+	uintptr_t i = (uintptr_t)rsocket & SOCKET_INDEX_MASK;
+	struct socket_slot *chunk = __atomic_load_n(&socket_table[i >> SOCKET_CHUNK_BITS], __ATOMIC_ACQUIRE);
+	if(chunk == NULL)
+		return NULL;
+	struct socket_slot *slot = &chunk[i & (SOCKET_CHUNK - 1)];
+	// Counted before the socket is looked at; free_socket removes it
+	// before it looks at the count
+	__atomic_fetch_add(&slot->submitters, 1, __ATOMIC_SEQ_CST);
+	struct sockets *socket = __atomic_load_n(&slot->socket, __ATOMIC_SEQ_CST);
+	if(socket == NULL || socket->rsock != rsocket || __atomic_load_n(&socket->submit_closed, __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_sub(&slot->submitters, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	return socket;
+}
+
+/*
+ * release_socket: Let free_socket free a socket of hold_socket again.
+ */
+void release_socket(rudp_socket_t rsocket) {
+	uintptr_t i = (uintptr_t)rsocket & SOCKET_INDEX_MASK;
+	__atomic_fetch_sub(&SOCKET_SLOT(i)->submitters, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * free_socket: Remove a closed socket from the table of sockets and free
+ * it with its sessions and packet pool.
+ */
+void free_socket(struct sockets *socket) {
+	pthread_mutex_lock(&socket_lock);
+	struct socket_slot *slot = SOCKET_SLOT((uintptr_t)socket->rsock & SOCKET_INDEX_MASK);
+	__atomic_store_n(&slot->socket, NULL, __ATOMIC_SEQ_CST);
+	slot->generation = ((uintptr_t)socket->rsock >> SOCKET_INDEX_BITS) + 1;
+	pthread_mutex_unlock(&socket_lock);
+
+	// Other threads that found the socket before it was removed are done
+	// with it soon: they only push a request and wake the loop
+	while(__atomic_load_n(&slot->submitters, __ATOMIC_SEQ_CST) != 0)
+		sched_yield();
+
+	while(socket->sessions_list_head != NULL) {
+		struct session *session = socket->sessions_list_head;
+		socket->sessions_list_head = session->next;
+		free_session(session);
 	}
-	if(new_session_created==1)
-	{
-		//Sending the SYN for the new session
-		struct rudp_hdr *syn=malloc(sizeof(struct rudp_hdr));
-		syn->type=RUDP_SYN;
-		syn->version=RUDP_VERSION;
-		syn->seqno=seq_no;
-		struct rudp_packet *p = malloc(sizeof(struct rudp_packet));
-		p->header = *syn;
-		p->payload_length = 0;
-		send_packet(0, rsocket, p, to,0);
+	complete_packets(socket);
+
+	if(socket->group_fd >= 0) {
+		event_fd_delete(groupCallback, socket);
+		close(socket->group_fd);
+	}
+
+	// Requests of other threads that have not been carried out
+	event_fd_delete(submitCallback, socket);
+	close(socket->submit_fd[0]);
+	if(socket->submit_fd[1] != socket->submit_fd[0])
+		close(socket->submit_fd[1]);
+	struct rudp_request *request = __atomic_exchange_n(&socket->submit_head, NULL, __ATOMIC_ACQUIRE);
+	while(request != NULL) {
+		struct rudp_request *next = request->next;
+		free(request);
+		request = next;
+	}
+	while(socket->backlog != NULL) {
+		request = socket->backlog;
+		socket->backlog = request->next;
+		free(request);
+	}
+
+	free(socket->session_table);
+	free(socket->io);
+	pool_destroy(&socket->packets);
+	pool_destroy(&socket->refs);
+	pool_destroy(&socket->shared);
+	free(socket);
+}
+
+/*
+ * rudp_random: Random number for the sockets of the calling thread. The
+ * generator of each thread is seeded with the time and the address of its
+ * state, which differs between threads.
+ */
+u_int32_t rudp_random(void) {
+	if(!rng_seeded) {
+		rng_state = time(NULL) ^ (uintptr_t)&rng_state;
+		rng_seeded = 1;
+	}
+	return rand_r(&rng_state);
+}
+
+/*
+ * session_hash: Hash of a peer's address and port.
+ */
+u_int32_t session_hash(struct sockaddr_in *addr) {
+	u_int32_t h = addr->sin_addr.s_addr * 0x9e3779b1u ^ addr->sin_port * 0x85ebca6bu;
+	return h ^ (h >> 16);
+}
+
+/*
+ * find_session: Find the session with the peer at addr, or NULL.
+ */
+struct session *find_session(struct sockets *socket, struct sockaddr_in *addr) {
+	if(socket->session_table == NULL)
+		return NULL;
+	u_int32_t i = session_hash(addr) & socket->session_mask;
+	struct session *session;
+	while((session = socket->session_table[i]) != NULL) {
+		if(session != SESSION_REMOVED && session->address->sin_addr.s_addr == addr->sin_addr.s_addr &&
+		   session->address->sin_port == addr->sin_port && session->address->sin_family == addr->sin_family)
+			return session;
+		i = (i + 1) & socket->session_mask;
+	}
+	return NULL;
+}
+
+/*
+ * new_session: Create a session with the peer at addr, without a sender
+ * or receiver session. Finished sessions may be evicted to make room.
+ */
+struct session *new_session(struct sockets *socket, struct sockaddr_in *addr) {
+	evict_sessions(socket);
+
+	struct session *session = malloc(sizeof(struct session));
+	session->address = malloc(sizeof(struct sockaddr_in));
+	bcopy(addr, session->address, sizeof(struct sockaddr_in));
+	session->sender = NULL;
+	session->receiver = NULL;
+	session->finished_next = NULL;
+	session->finished_queued = 0;
+	if(session_table_insert(socket, session) < 0) {
+		free(session->address);
+		free(session);
+		return NULL;
+	}
+
+	session->prev = NULL;
+	session->next = socket->sessions_list_head;
+	if(session->next != NULL)
+		session->next->prev = session;
+	socket->sessions_list_head = session;
+	return session;
+}
+
+/*
+ * session_table_insert: Add a session to the hash table of a socket,
+ * growing it when it is half full.
+ */
+int session_table_insert(struct sockets *socket, struct session *session) {
+	if(socket->session_table == NULL || (socket->session_slots_used + 1) * 2 > socket->session_mask + 1) {
+		// Rehash into a table that is at most a quarter full
+		u_int32_t size = RUDP_SESSION_TABLE;
+		while(size < (socket->sessions + 1) * 4)
+			size <<= 1;
+		struct session **table = calloc(size, sizeof(struct session *));
+		if(table == NULL) {
+			perror("rudp: calloc");
+			return -1;
+		}
+		u_int32_t i, j;
+		for(i = 0; socket->session_table != NULL && i <= socket->session_mask; i++) {
+			struct session *s = socket->session_table[i];
+			if(s == NULL || s == SESSION_REMOVED)
+				continue;
+			for(j = session_hash(s->address) & (size - 1); table[j] != NULL; j = (j + 1) & (size - 1))
+				;
+			table[j] = s;
+		}
+		free(socket->session_table);
+		socket->session_table = table;
+		socket->session_mask = size - 1;
+		socket->session_slots_used = socket->sessions;
 	}
+
+	u_int32_t i = session_hash(session->address) & socket->session_mask;
+	while(socket->session_table[i] != NULL && socket->session_table[i] != SESSION_REMOVED)
+		i = (i + 1) & socket->session_mask;
+	if(socket->session_table[i] == NULL)
+		socket->session_slots_used++;
+	socket->session_table[i] = session;
+	socket->sessions++;
 	return 0;
 }
 
-int timeoutCallback(int fd, void *args) {
-	struct timeoutargs *timeargs=(struct timeoutargs*)args;
-	struct sockets *temp = sockets_list_head;
-	while(temp != NULL) {
-		if(temp->rsock == timeargs->fd) {
+/*
+ * remove_session: Take a session out of the hash table and the list of
+ * sessions of a socket and free it.
+ */
+void remove_session(struct sockets *socket, struct session *session) {
+	u_int32_t i = session_hash(session->address) & socket->session_mask;
+	while(socket->session_table[i] != session)
+		i = (i + 1) & socket->session_mask;
+	// The slot may be on the probe path of another session, so it is not emptied
+	socket->session_table[i] = SESSION_REMOVED;
+	socket->sessions--;
+
+	if(session->prev != NULL)
+		session->prev->next = session->next;
+	else
+		socket->sessions_list_head = session->next;
+	if(session->next != NULL)
+		session->next->prev = session->prev;
+	free_session(session);
+}
+
+/*
+ * free_session: Free a session with its sender and receiver sessions.
+ */
+void free_session(struct session *session) {
+	if(session->sender != NULL)
+		free_sender_session(session->sender);
+	if(session->receiver != NULL)
+		free_receiver_session(session->receiver);
+	free(session->address);
+	free(session);
+}
+
+/*
+ * finish_session: Called when the sender or receiver session of a session
+ * has finished. Once both have, the session is queued for eviction, which
+ * happens when new sessions are created.
+ */
+void finish_session(struct sockets *socket, struct session *session) {
+	if((session->sender != NULL && !session->sender->sessionFinished) ||
+	   (session->receiver != NULL && !session->receiver->sessionFinished))
+		return;
+	gettimeofday(&session->finished_time, NULL);
+	if(!session->finished_queued) {
+		session->finished_queued = 1;
+		session->finished_next = NULL;
+		if(socket->finished_tail != NULL)
+			socket->finished_tail->finished_next = session;
+		else
+			socket->finished_head = session;
+		socket->finished_tail = session;
+		socket->finished++;
+	}
+}
+
+/*
+ * evict_sessions: Remove the sessions that finished more than
+ * RUDP_SESSION_LINGER milliseconds ago, and the oldest finished sessions
+ * while there are more than RUDP_MAXFINISHED. A finished session is kept
+ * for a while, so that a FIN that is retransmitted because our ACK was
+ * lost is still ACKed.
+ */
+void evict_sessions(struct sockets *socket) {
+	struct timeval now, elapsed;
+	gettimeofday(&now, NULL);
+	while(socket->finished_head != NULL) {
+		struct session *session = socket->finished_head;
+		timersub(&now, &session->finished_time, &elapsed);
+		if(socket->finished <= RUDP_MAXFINISHED &&
+		   elapsed.tv_sec * 1000L + elapsed.tv_usec / 1000 < RUDP_SESSION_LINGER)
 			break;
+
+		socket->finished_head = session->finished_next;
+		if(socket->finished_head == NULL)
+			socket->finished_tail = NULL;
+		socket->finished--;
+		session->finished_queued = 0;
+		// It may have been reused since it finished
+		if((session->sender == NULL || session->sender->sessionFinished) &&
+		   (session->receiver == NULL || session->receiver->sessionFinished))
+			remove_session(socket, session);
+	}
+}
+
+/*
+ * rtt_sample: Update the round-trip time estimate with a packet sent at
+ * sent_time that has just been acknowledged, and derive a new
+ * retransmission timeout from it as in RFC 6298. Returns the sample.
+ */
+long rtt_sample(struct sender_session *sender, struct timeval *sent_time) {
+	struct timeval now, elapsed;
+	gettimeofday(&now, NULL);
+	timersub(&now, sent_time, &elapsed);
+	long rtt = elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+	if(rtt <= 0)
+		rtt = 1;
+
+	if(sender->srtt == 0) {
+		sender->srtt = rtt;
+		sender->rttvar = rtt / 2;
+	}
+	else {
+		long delta = sender->srtt > rtt ? sender->srtt - rtt : rtt - sender->srtt;
+		sender->rttvar = (3 * sender->rttvar + delta) / 4;
+		sender->srtt = (7 * sender->srtt + rtt) / 8;
+	}
+
+	sender->rto = sender->srtt + (4 * sender->rttvar > RUDP_CLOCK_GRANULARITY ? 4 * sender->rttvar : RUDP_CLOCK_GRANULARITY);
+	if(sender->rto < sender->rto_min)
+		sender->rto = sender->rto_min;
+	if(sender->rto > sender->rto_max)
+		sender->rto = sender->rto_max;
+	return rtt;
+}
+
+/*
+ * rto_backoff: Double the retransmission timeout after a timer set with
+ * timer_rto has expired. Timers set with any other value were armed before
+ * the latest backoff or RTT sample, so they do not double it again and one
+ * loss burst only backs off once. Returns 1 if it was doubled.
+ */
+int rto_backoff(struct sender_session *sender, long timer_rto) {
+	if(timer_rto != sender->rto)
+		return 0;
+	sender->rto *= 2;
+	if(sender->rto > sender->rto_max)
+		sender->rto = sender->rto_max;
+	return 1;
+}
+
+/*
+ * window_slot: Find the window slot of an unacknowledged packet.
+ * Returns NULL if seqno is not in the window.
+ */
+struct window_slot *window_slot(struct sender_session *sender, u_int32_t seqno) {
+	if((u_int32_t)(seqno - sender->window_base) >= (u_int32_t)sender->in_flight)
+		return NULL;
+	return &sender->window[seqno & sender->window_mask];
+}
+
+/*
+ * window_ack: Process an ACK for DATA. It acknowledges every packet before
+ * its seqno, and its optional SACK bitmap covers packets received out of
+ * order after that. Acknowledged packets at the start of the window are
+ * removed from it. Returns the number of packets newly acknowledged, and
+ * sets rtt to the RTT sample it gave in microseconds, or 0.
+ */
+int window_ack(struct sender_session *sender, struct rudp_packet *ack, long *rtt) {
+	int newly_acked = 0;
+	u_int32_t seq;
+	struct window_slot *slot;
+	struct timeval latest_sent;
+	timerclear(&latest_sent);
+
+	for(seq = sender->window_base; SEQ_LT(seq, ack->header.seqno) && (slot = window_slot(sender, seq)) != NULL; seq++) {
+		if(slot->acked == 0) {
+			event_timer_cancel(slot->timer);
+			slot->acked = 1;
+			newly_acked++;
+			if(slot->retransmission_attempts == 0 && timercmp(&slot->sent_time, &latest_sent, >))
+				latest_sent = slot->sent_time;
 		}
-		temp = temp->next;
-	}
-	if(temp->rsock == timeargs->fd) {
-		int sessionFound = 0;
-			// Check if we already have a session for this peer
-			struct session *temp2 = temp->sessions_list_head;
-			while(temp2 != NULL) {
-				if(temp2->address->sin_addr.s_addr == timeargs->recipient->sin_addr.s_addr && temp2->address->sin_port == timeargs->recipient->sin_port && temp2->address->sin_family == timeargs->recipient->sin_family) {
-					// Found an existing session
-					sessionFound = 1;
-					break;
-				}
+	}
 
-				temp2 = temp2->next;
-			}
-			if(sessionFound == 1) {
-				if(timeargs->packet->header.type==RUDP_SYN)
-				{
-					if(temp2->sender->syn_retransmit_attempts>=RUDP_MAXRETRANS)
-					{
-						temp->handler(timeargs->fd,RUDP_EVENT_TIMEOUT,timeargs->recipient);
-					}
-					else
-					{
-						temp2->sender->syn_retransmit_attempts++;
-						send_packet(0,timeargs->fd,timeargs->packet,timeargs->recipient,1);
-					}
-				}
-				else if(timeargs->packet->header.type==RUDP_FIN)
-				{
-					if(temp2->sender->fin_retransmit_attempts>=RUDP_MAXRETRANS)
-					{
-						temp->handler(timeargs->fd,RUDP_EVENT_TIMEOUT,timeargs->recipient);
-					}
-					else
-					{
-						temp2->sender->fin_retransmit_attempts++;
-						send_packet(0,timeargs->fd,timeargs->packet,timeargs->recipient,1);
-					}
-				}
-				else{
-					int i;
-					int index;
-					for(i = 0; i < RUDP_WINDOW; i++) {
-						if(temp2->sender->sliding_window[i] != NULL && temp2->sender->sliding_window[i]->header.seqno==timeargs->packet->header.seqno) {
-							index = i;
-						}
-					}
+	int i;
+	for(i = 0; i < ack->payload_length * 8; i++) {
+		if((ack->payload[i / 8] & (1 << (i % 8))) == 0)
+			continue;
+		slot = window_slot(sender, ack->header.seqno + (u_int32_t)i + (u_int32_t)1);
+		if(slot != NULL && slot->acked == 0) {
+			event_timer_cancel(slot->timer);
+			slot->acked = 1;
+			newly_acked++;
+			if(slot->retransmission_attempts == 0 && timercmp(&slot->sent_time, &latest_sent, >))
+				latest_sent = slot->sent_time;
+		}
+	}
 
-					if(temp2->sender->retransmission_attempts[index]>=RUDP_MAXRETRANS)
-					{
-						temp->handler(timeargs->fd,RUDP_EVENT_TIMEOUT,timeargs->recipient);
-					}
-					else
-					{
-						temp2->sender->retransmission_attempts[index]++;
-						send_packet(0,timeargs->fd,timeargs->packet,timeargs->recipient,1);
-					}
-				}
+	// Take an RTT sample from the most recently sent packet this ACK covers.
+	// Karn's rule: retransmitted packets are ambiguous and give no sample.
+	*rtt = 0;
+	if(timerisset(&latest_sent))
+		*rtt = rtt_sample(sender, &latest_sent);
+
+	// Slide the window past the acknowledged packets at its start
+	while(sender->in_flight > 0 && (slot = &sender->window[sender->window_base & sender->window_mask])->acked) {
+		release_packet(sender->socket, slot->packet, 1);
+		bzero(slot, sizeof(struct window_slot));
+		sender->window_base++;
+		sender->in_flight--;
+	}
+	return newly_acked;
+}
+
+/*
+ * fill_window: Move queued data into free window slots and send it, as far
+ * as the congestion window allows. The first two duplicate ACKs each let
+ * one more packet out, so that a loss in a small window still produces
+ * enough ACKs to be detected (limited transmit, RFC 3042).
+ */
+void fill_window(struct sockets *socket, struct session *session) {
+	struct sender_session *sender = session->sender;
+	int cwnd = rudp_cc_window(&sender->cc);
+	if(!sender->cc.in_recovery)
+		cwnd += sender->dupacks < 2 ? sender->dupacks : 2;
+	while(sender->data_queue != NULL && sender->in_flight < sender->window_size && sender->in_flight < cwnd) {
+		// The queued packet moves into the window as it is, unless it is larger
+		// than the session sends now
+		struct rudp_packet *datap = sender->data_queue;
+		if(datap->payload_length > sender->mss && !sender->member && split_packet(sender, datap) < 0)
+			break;
+		sender->data_queue = datap->next;
+		if(sender->data_queue == NULL)
+			sender->data_tail = NULL;
+		sender->queued--;
+		sender->seqNo = (sender->seqNo + (u_int32_t)1);
+		datap->header.type = RUDP_DATA;
+		datap->header.version = RUDP_VERSION;
+		datap->header.seqno = sender->seqNo;
+
+		struct window_slot *slot = &sender->window[sender->seqNo & sender->window_mask];
+		slot->packet = datap;
+		slot->retransmission_attempts = 0;
+		slot->acked = 0;
+		slot->timer = EVENT_TIMER_NONE;
+		sender->in_flight++;
+		if(!sender->member)
+			send_packet(0, socket, datap, session->address, 0);
+	}
+	if(sender->member)
+		send_group(socket);
+}
+
+/*
+ * fast_retransmit: Resend the packet at the start of the window before its
+ * timer expires, because later ACKs show that it was lost.
+ */
+void fast_retransmit(struct sockets *socket, struct session *session) {
+	struct sender_session *sender = session->sender;
+	struct window_slot *slot = window_slot(sender, sender->window_base);
+	if(slot == NULL || slot->acked || slot->retransmission_attempts >= RUDP_MAXRETRANS || !timerisset(&slot->sent_time))
+		return;
+	event_timer_cancel(slot->timer);
+	slot->retransmission_attempts++;
+	RUDP_LOG(RUDP_LOG_DEBUG, RUDP_LOG_CC, RUDP_LOGEV_FASTRETRANS, sender->window_base, session->address->sin_addr.s_addr, session->address->sin_port, rudp_cc_window(&sender->cc), 0);
+	resend_data(socket, session, slot);
+}
+
+/*
+ * send_group: Send the packets that every member of the multicast group
+ * has moved into its window to the group, once each, and start the timer
+ * of the copy of each member. The fullest window holds the group back.
+ */
+void send_group(struct sockets *socket) {
+	struct session *session;
+	for(;;) {
+		u_int32_t seqno = socket->group_seq + (u_int32_t)1;
+		struct window_slot *slot = NULL;
+		for(session = socket->sessions_list_head; session != NULL; session = session->next) {
+			if(session->sender == NULL || !session->sender->member)
+				continue;
+			if((slot = window_slot(session->sender, seqno)) == NULL)
+				return;
+		}
+		if(slot == NULL)
+			return;
+
+		// No timer for the group, each member has its own
+		send_packet(1, socket, slot->packet, &socket->group, 0);
+		for(session = socket->sessions_list_head; session != NULL; session = session->next) {
+			if(session->sender != NULL && session->sender->member)
+				start_timer(socket, window_slot(session->sender, seqno)->packet, session->address);
+		}
+		socket->group_seq = seqno;
+	}
+}
+
+/*
+ * resend_data: Retransmit a DATA packet whose loss has been detected. A
+ * member of a multicast group waits for a repair that was sent to the
+ * group less than a round trip ago, and the repair is sent to the group
+ * if other members have reported the loss too. Otherwise it is sent to
+ * the peer alone.
+ */
+void resend_data(struct sockets *socket, struct session *session, struct window_slot *slot) {
+	struct sender_session *sender = session->sender;
+	struct rudp_packet *p = slot->packet;
+	if(!sender->member) {
+		send_packet(0, socket, p, session->address, 1);
+		return;
+	}
+
+	struct group_repair *repair = &socket->repairs[p->header.seqno & (RUDP_GROUP_REPAIRS - 1)];
+	struct timeval now, elapsed;
+	gettimeofday(&now, NULL);
+	timersub(&now, &repair->time, &elapsed);
+	if(repair->seqno == p->header.seqno && timerisset(&repair->time) &&
+	   elapsed.tv_sec * 1000000L + elapsed.tv_usec < (sender->srtt > 0 ? sender->srtt : sender->rto)) {
+		start_timer(socket, p, session->address);
+		return;
+	}
+
+	// Members that have had the packet retransmitted, or whose duplicate
+	// ACKs are asking for it
+	struct session *other;
+	int missing = 0;
+	for(other = socket->sessions_list_head; other != NULL; other = other->next) {
+		if(other == session || other->sender == NULL || !other->sender->member)
+			continue;
+		struct window_slot *s = window_slot(other->sender, p->header.seqno);
+		if(s != NULL && !s->acked && (s->retransmission_attempts > 0 ||
+		   (other->sender->dupacks > 0 && other->sender->window_base == p->header.seqno)))
+			missing++;
+	}
+	if(missing == 0) {
+		send_packet(0, socket, p, session->address, 1);
+		return;
+	}
+	send_packet(1, socket, p, &socket->group, 1);
+	repair->seqno = p->header.seqno;
+	repair->time = now;
+	start_timer(socket, p, session->address);
+}
+
+/*
+ * send_ack: Send an ACK carrying seqno to a peer.
+ */
+int send_ack(struct sockets *socket, struct sockaddr_in *to, u_int32_t seqno) {
+	struct rudp_packet ack;
+	ack.payload = NULL;
+	ack.header.type = RUDP_ACK;
+	ack.header.version = RUDP_VERSION;
+	ack.header.flags = 0;
+	ack.header.seqno = seqno;
+	ack.payload_length = 0;
+	ack.iovcnt = 0;
+	return send_packet(1, socket, &ack, to, 0);
+}
+
+/*
+ * send_data_ack: Send a cumulative ACK for everything the receiver has
+ * passed on, with a SACK bitmap for the packets held in its reorder buffer.
+ */
+int send_data_ack(struct sockets *socket, struct sockaddr_in *to, struct receiver_session *receiver) {
+	struct rudp_packet ack;
+	char sack[RUDP_SACK_BYTES(RUDP_MAXWINDOW)];
+	ack.payload = sack;
+	// It covers any ACK that has been held back
+	event_timer_cancel(receiver->ack_timer);
+	receiver->ack_timer = EVENT_TIMER_NONE;
+	receiver->unacked = 0;
+
+	ack.header.type = RUDP_ACK;
+	ack.header.version = RUDP_VERSION;
+	ack.header.flags = 0;
+	ack.header.seqno = receiver->expected_seqNo;
+	ack.payload_length = 0;
+	ack.iovcnt = 0;
+
+	// Bit i stands for packet expected_seqNo+1+i. Only send the bytes up to the last one set.
+	if(receiver->buffered > 0) {
+		u_int32_t i;
+		u_int32_t bits = receiver->highest_seqNo - receiver->expected_seqNo;
+		if(bits > RUDP_MAXWINDOW)
+			bits = RUDP_MAXWINDOW;
+		bzero(ack.payload, RUDP_SACK_BYTES(bits));
+		for(i = 0; i < bits; i++) {
+			u_int32_t seq = receiver->expected_seqNo + i + (u_int32_t)1;
+			struct rudp_packet *buffered = receiver->reorder_buffer[seq & receiver->window_mask];
+			if(buffered != NULL && buffered->header.seqno == seq) {
+				ack.payload[i / 8] |= 1 << (i % 8);
+				ack.payload_length = i / 8 + 1;
 			}
 		}
+	}
+	return send_packet(1, socket, &ack, to, 0);
+}
+
+/*
+ * delay_ack: Acknowledge a DATA packet that was received in order. The
+ * ACK is sent when ack_every packets have arrived since the last one, or
+ * when ack_delay has passed, whichever comes first. For a window after a
+ * packet arrived out of order, every packet is ACKed at once, so that the
+ * sender, whose window is likely small then, recovers quickly.
+ */
+int delay_ack(struct receiver_session *receiver) {
+	if(receiver->quickacks > 0) {
+		receiver->quickacks--;
+		return send_data_ack(receiver->socket, receiver->peer, receiver);
+	}
+	if(++receiver->unacked >= receiver->ack_every)
+		return send_data_ack(receiver->socket, receiver->peer, receiver);
+	if(receiver->ack_timer == EVENT_TIMER_NONE) {
+		struct timeval now, delay, when;
+		gettimeofday(&now, NULL);
+		delay.tv_sec = receiver->ack_delay / 1000000;
+		delay.tv_usec = receiver->ack_delay % 1000000;
+		timeradd(&now, &delay, &when);
+		receiver->ack_timer = event_timer(when, ackTimeoutCallback, receiver, "ackTimeoutCallback");
+	}
+	return 0;
+}
 
+int ackTimeoutCallback(int fd, void *arg) {
+	struct receiver_session *receiver = arg;
+	receiver->ack_timer = EVENT_TIMER_NONE;
+	send_data_ack(receiver->socket, receiver->peer, receiver);
 	return 0;
 }
 
-int send_packet(int isAck, rudp_socket_t rsocket, struct rudp_packet *p, struct sockaddr_in *recipient,int retransmission) {
-	// Send packet on UDP socket
+/*
+ * deliver_packet: Pass the payload of a DATA packet received in order to
+ * the application, or add it to the message of several packets it belongs
+ * to. Returns 1 if the application keeps the packet until rudp_release.
+ */
+int deliver_packet(struct sockets *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p) {
+	if((p->header.flags & (RUDP_FLAG_FIRST | RUDP_FLAG_LAST)) != (RUDP_FLAG_FIRST | RUDP_FLAG_LAST))
+		return reassemble(socket, receiver, from, p);
+	if(socket->recv_handler == NULL)
+		return 0;
+	socket->recv_handler(socket->rsock, from, p->payload, p->payload_length);
+	return socket->recv_loan;
+}
+
+/*
+ * reassemble: Add the payload of p to the message being reassembled, and
+ * pass the message to the application when p is its last packet. A message
+ * that grows beyond RUDP_MAXMSGSIZE is dropped. Returns 0, p is not kept.
+ */
+int reassemble(struct sockets *socket, struct receiver_session *receiver, struct sockaddr_in *from, struct rudp_packet *p) {
+	struct rudp_packet *message = receiver->message;
+
+	if(p->header.flags & RUDP_FLAG_FIRST) {
+		free(message);
+		message = NULL;
+		receiver->message_size = socket->mss * 4;
+		if((receiver->message = message = malloc(sizeof(struct rudp_packet) + receiver->message_size)) == NULL) {
+			perror("reassemble: malloc");
+			return 0;
+		}
+		message->header.type = RUDP_MESSAGE;
+		message->payload = (char *)(message + 1);
+		message->payload_length = 0;
+	}
+	if(message == NULL)
+		return 0; // The rest of a message that was dropped
+
+	if(message->payload_length + p->payload_length > receiver->message_size) {
+		int size = receiver->message_size * 2;
+		if(size > RUDP_MAXMSGSIZE)
+			size = RUDP_MAXMSGSIZE;
+		if(message->payload_length + p->payload_length > size)
+			fprintf(stderr, "reassemble: Dropping a message larger than %d bytes\n", RUDP_MAXMSGSIZE);
+		else if((message = realloc(message, sizeof(struct rudp_packet) + size)) == NULL)
+			perror("reassemble: realloc");
+		if(message == NULL || message->payload_length + p->payload_length > size) {
+			free(receiver->message);
+			receiver->message = NULL;
+			return 0;
+		}
+		message->payload = (char *)(message + 1);
+		receiver->message = message;
+		receiver->message_size = size;
+	}
+	bcopy(p->payload, message->payload + message->payload_length, p->payload_length);
+	message->payload_length += p->payload_length;
+
+	if(p->header.flags & RUDP_FLAG_LAST) {
+		receiver->message = NULL;
+		if(socket->recv_handler != NULL)
+			socket->recv_handler(socket->rsock, from, message->payload, message->payload_length);
+		if(socket->recv_handler == NULL || !socket->recv_loan)
+			free(message);
+	}
+	return 0;
+}
+
+/*
+ * packet_get: Take a packet from the pool of socket, with room for a
+ * payload of the socket's MSS.
+ */
+struct rudp_packet *packet_get(struct sockets *socket) {
+	struct rudp_packet *p = pool_get(&socket->packets);
+	if(p != NULL) {
+		p->payload = (char *)(p + 1);
+		p->shared = NULL;
+	}
+	return p;
+}
 
+/*
+ * packet_ref: Take a packet without room for a payload, for one that is
+ * sent from buffers elsewhere, so that they cost no more than a header.
+ */
+struct rudp_packet *packet_ref(struct sockets *socket) {
+	struct rudp_packet *p = pool_get(&socket->refs);
+	if(p != NULL) {
+		p->payload = NULL;
+		p->shared = NULL;
+	}
+	return p;
+}
 
-	char *type=malloc(5);
-	int t=p->header.type;
-	if(t==1)
-		{type="DATA";}
-	else if(t==2)
-		{type="ACK";}
-	else if(t==4)
-		{type="SYN";}
-	else if(t==5)
-		{type="FIN";}
+/*
+ * packet_put: Return a packet of packet_get or packet_ref to its pool.
+ */
+void packet_put(struct sockets *socket, struct rudp_packet *p) {
+	if(p->payload == NULL)
+		pool_put(&socket->refs, p);
 	else
-		{type="BAD";}
-	printf("Sending %s packet to %s:%d seq number=%u on socket=%d\n",type, inet_ntoa(recipient->sin_addr), ntohs(recipient->sin_port),p->header.seqno,rsocket);
+		pool_put(&socket->packets, p);
+}
 
-		if (DROP != 0 && rand() % DROP == 1) {
-			  printf("Dropped\n");
+/*
+ * packet_read: Copy len bytes of the payload of p, from offset on, to buf.
+ */
+void packet_read(struct rudp_packet *p, int offset, char *buf, int len) {
+	int i;
+	if(p->iovcnt == 0) {
+		bcopy(p->payload + offset, buf, len);
+		return;
+	}
+	for(i = 0; i < p->iovcnt && len > 0; i++) {
+		int n = p->iov[i].iov_len;
+		if(offset >= n) {
+			offset -= n;
+			continue;
 		}
-		else
-		{
-			if (sendto(rsocket, p, sizeof(struct rudp_packet), 0, (struct sockaddr*)recipient, sizeof(struct sockaddr_in)) < 0) {
-				fprintf(stderr, "rudp_sendto: sendto failed\n");
-				return -1;
+		n -= offset;
+		if(n > len)
+			n = len;
+		bcopy((char *)p->iov[i].iov_base + offset, buf, n);
+		offset = 0;
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * split_packet: Cut a queued packet down to the MSS of the session. The
+ * rest of its payload is copied into packets that are queued after it,
+ * and the message flags are moved so that the receiver puts the pieces
+ * together again. Returns -1 if the pool is out of memory.
+ */
+int split_packet(struct sender_session *sender, struct rudp_packet *p) {
+	struct rudp_packet *first = NULL, *last = NULL;
+	int offset = sender->mss;
+	int i, n;
+
+	while(offset < p->payload_length) {
+		struct rudp_packet *piece = packet_get(sender->socket);
+		if(piece == NULL) {
+			while(first != NULL) {
+				piece = first;
+				first = first->next;
+				pool_put(&sender->socket->packets, piece);
 			}
+			return -1;
 		}
+		piece->payload_length = p->payload_length - offset < sender->mss ? p->payload_length - offset : sender->mss;
+		packet_read(p, offset, piece->payload, piece->payload_length);
+		piece->iovcnt = 0;
+		piece->header.flags = 0;
+		offset += piece->payload_length;
+		sender->queued++;
+		piece->next = NULL;
+		if(last == NULL)
+			first = piece;
+		else
+			last->next = piece;
+		last = piece;
+	}
+	last->header.flags = p->header.flags & RUDP_FLAG_LAST;
+	last->next = p->next;
+	p->next = first;
+	if(sender->data_tail == p)
+		sender->data_tail = last;
+	p->header.flags &= ~RUDP_FLAG_LAST;
+
+	// The caller's buffers of a packet of rudp_sendv are cut at the MSS
+	p->payload_length = sender->mss;
+	for(i = 0, n = 0; i < p->iovcnt && n < sender->mss; i++) {
+		if(n + (int)p->iov[i].iov_len > sender->mss)
+			p->iov[i].iov_len = sender->mss - n;
+		n += p->iov[i].iov_len;
+	}
+	if(p->iovcnt > 0)
+		p->iovcnt = i;
+	return 0;
+}
 
-	if(isAck == 0) {
-		// Set a timeout event, unless the packet is an ACK
-		struct timeoutargs *timeargs=malloc(sizeof(struct timeoutargs));
-		timeargs->packet=malloc(sizeof(struct rudp_packet));
-		timeargs->recipient=malloc(sizeof(struct sockaddr_in));
-		timeargs->fd=rsocket;
-		bcopy(p,timeargs->packet,sizeof(struct rudp_packet));
-		bcopy(recipient,timeargs->recipient,sizeof(struct sockaddr_in));
-		struct timeval currentTime;
-		gettimeofday(&currentTime, NULL);
-		struct timeval delay;
-		delay.tv_sec = RUDP_TIMEOUT/1000;
-		delay.tv_usec= 0;
-		struct timeval timeoutTime;
-		timeradd(&currentTime, &delay, &timeoutTime);
-		struct sockets *temp = sockets_list_head;
-		while(temp != NULL) {
-			if(temp->rsock == timeargs->fd) {
-				break;
-			}
-			temp = temp->next;
+/*
+ * send_syn_ack: ACK a SYN, telling the peer the largest payload we accept.
+ */
+int send_syn_ack(struct sockets *socket, struct sockaddr_in *to, u_int32_t seqno) {
+	struct rudp_packet ack;
+	u_int16_t mss = htons(socket->mss);
+	ack.header.type = RUDP_ACK;
+	ack.header.version = RUDP_VERSION;
+	ack.header.flags = RUDP_FLAG_SYNACK;
+	ack.header.seqno = seqno;
+	ack.payload = (char *)&mss;
+	ack.payload_length = sizeof(mss);
+	ack.iovcnt = 0;
+	return send_packet(1, socket, &ack, to, 0);
+}
+
+/*
+ * set_mss: Choose the MSS of a sender session when the ACK of its SYN has
+ * arrived. With RUDP_OPT_PMTUD it starts at RUDP_MAXPKTSIZE, and probes
+ * find out how much more the path carries.
+ * Returns -1 for a member of a multicast group that does not accept the
+ * packets of the group, which are not split for it.
+ */
+int set_mss(struct sockets *socket, struct sender_session *sender, struct rudp_packet *syn_ack) {
+	int peer_mss = RUDP_MAXPKTSIZE;
+	if((syn_ack->header.flags & RUDP_FLAG_SYNACK) && syn_ack->payload_length >= 2) {
+		u_int16_t mss;
+		bcopy(syn_ack->payload, &mss, sizeof(mss));
+		peer_mss = ntohs(mss);
+	}
+	if(peer_mss < RUDP_MINMSS)
+		peer_mss = RUDP_MINMSS;
+	sender->mss_max = socket->mss < peer_mss ? socket->mss : peer_mss;
+	// Packets to the group hold up to RUDP_MAXPKTSIZE bytes, or the MSS of
+	// the socket if that is less
+	if(sender->member && sender->mss_max < socket->mss && sender->mss_max < RUDP_MAXPKTSIZE) {
+		fprintf(stderr, "rudp_sendto_group Error: A member of the multicast group accepts only %d bytes\n", peer_mss);
+		return -1;
+	}
+	// The path to a multicast group is not probed
+	if(!socket->pmtud || sender->member) {
+		sender->mss = sender->mss_max;
+		return 0;
+	}
+	sender->mss = sender->mss_max < RUDP_MAXPKTSIZE ? sender->mss_max : RUDP_MAXPKTSIZE;
+	send_probe(sender);
+	return 0;
+}
+
+/*
+ * send_probe: Send a PROBE padded to the next size to try, or stop probing
+ * once the MSS is within RUDP_PROBE_STEP bytes of the largest size that
+ * may work. The first probe tries the largest size, which often works on
+ * a LAN; after that the sizes are found by binary search. A probe that is
+ * too large for the interface fails at once.
+ */
+void send_probe(struct sender_session *sender) {
+	static char padding[RUDP_MAXMSS];
+	struct rudp_packet probe;
+
+	while(sender->mss_max - sender->mss >= RUDP_PROBE_STEP) {
+		if(sender->probe_tries == 0) {
+			sender->probe_size = sender->probes == 0 ? sender->mss_max : (sender->mss + sender->mss_max + 1) / 2;
+			sender->probe_seq++;
 		}
-		if(temp->rsock == timeargs->fd) {
-			int sessionFound = 0;
-				// Check if we already have a session for this peer
-				struct session *temp2 = temp->sessions_list_head;
-				while(temp2 != NULL) {
-					if(temp2->address->sin_addr.s_addr == timeargs->recipient->sin_addr.s_addr && temp2->address->sin_port == timeargs->recipient->sin_port && temp2->address->sin_family == timeargs->recipient->sin_family) {
-						// Found an existing session
-						sessionFound = 1;
-						break;
-					}
+		probe.header.type = RUDP_PROBE;
+		probe.header.version = RUDP_VERSION;
+		probe.header.flags = 0;
+		probe.header.seqno = sender->probe_seq;
+		probe.payload = padding;
+		probe.payload_length = sender->probe_size;
+		probe.iovcnt = 0;
+		if(send_packet(1, sender->socket, &probe, sender->peer, sender->probe_tries > 0) < 0) {
+			sender->mss_max = sender->probe_size - 1;
+			sender->probes++;
+			sender->probe_tries = 0;
+			continue;
+		}
+		sender->probe_tries++;
+
+		struct timeval now, delay, when;
+		gettimeofday(&now, NULL);
+		delay.tv_sec = sender->rto / 1000000;
+		delay.tv_usec = sender->rto % 1000000;
+		timeradd(&now, &delay, &when);
+		sender->probe_timer = event_timer(when, probeTimeoutCallback, sender, "probeTimeoutCallback");
+		return;
+	}
+	sender->probe_size = 0;
+}
 
-					temp2 = temp2->next;
-				}
-				if(sessionFound == 1) {
+int probeTimeoutCallback(int fd, void *arg) {
+	struct sender_session *sender = arg;
+	sender->probe_timer = EVENT_TIMER_NONE;
+	if(sender->probe_tries >= RUDP_PROBE_TRIES) {
+		// Probes of this size do not get through
+		sender->mss_max = sender->probe_size - 1;
+		sender->probes++;
+		sender->probe_tries = 0;
+	}
+	send_probe(sender);
+	return 0;
+}
 
-					if(timeargs->packet->header.type==RUDP_SYN)
-					{
-						temp2->sender->syn_timeout_arg=timeargs;
-					}
-					else if(timeargs->packet->header.type==RUDP_FIN)
-					{
-						temp2->sender->fin_timeout_arg=timeargs;
-					}
-					else if(timeargs->packet->header.type==RUDP_DATA)
-					{
-						int i;
-						int index;
-						for(i = 0; i < RUDP_WINDOW; i++) {
-							if(temp2->sender->sliding_window[i] != NULL && temp2->sender->sliding_window[i]->header.seqno==timeargs->packet->header.seqno) {
-								index = i;
-							}
-						}
-						temp2->sender->data_timeout_arg[index]=timeargs;
-					}
-				}
-			}
-			event_timeout(timeoutTime, timeoutCallback, timeargs, "timeoutCallback");
+/*
+ * packet_iov: Describe p in wire format as the header, which is built in
+ * wh, and the payload where it is. Returns the number of entries used in
+ * iov, which has room for RUDP_MAXIOV + 1.
+ */
+int packet_iov(struct rudp_packet *p, struct rudp_wirehdr *wh, struct iovec *iov) {
+	int i;
+	wh->hdr.version = htons(p->header.version);
+	wh->hdr.type = htons(p->header.type);
+	wh->hdr.seqno = htonl(p->header.seqno);
+	wh->hdr.flags = htons(p->header.flags);
+	wh->length = htons(p->payload_length);
+	iov[0].iov_base = wh;
+	iov[0].iov_len = RUDP_HDRLEN;
+	if(p->iovcnt == 0) {
+		iov[1].iov_base = p->payload;
+		iov[1].iov_len = p->payload_length;
+		return 2;
+	}
+	for(i = 0; i < p->iovcnt; i++)
+		iov[i + 1] = p->iov[i];
+	return p->iovcnt + 1;
+}
+
+/*
+ * release_packet: Give back a DATA packet that has been acknowledged, or
+ * will not be sent because its session is gone. While packets are held
+ * back by queue_send, it may be one of them, so it is only put back, and
+ * the sent handler of a packet of rudp_sendv called, by complete_packets.
+ */
+void release_packet(struct sockets *socket, struct rudp_packet *p, int delivered) {
+	struct io_batch *io = socket->io;
+	if(p->iovcnt == 0 && io->tx_count == 0) {
+		pool_put(&socket->packets, p);
+		return;
+	}
+	p->delivered = delivered;
+	p->next = NULL;
+	if(io->sent_tail == NULL)
+		io->sent_head = p;
+	else
+		io->sent_tail->next = p;
+	io->sent_tail = p;
+}
+
+/*
+ * complete_packets: Put back the packets given to release_packet, telling
+ * the application, in the order they were released, that the buffers of
+ * those of rudp_sendv may be reused, and dropping their references to
+ * the buffers of rudp_sendto_group.
+ */
+void complete_packets(struct sockets *socket) {
+	struct io_batch *io = socket->io;
+	while(io->sent_head != NULL) {
+		struct rudp_packet *p = io->sent_head;
+		io->sent_head = p->next;
+		if(io->sent_head == NULL)
+			io->sent_tail = NULL;
+		if(p->shared != NULL) {
+			if(--p->shared->refs == 0)
+				pool_put(&socket->shared, p->shared);
+		}
+		else if(p->iovcnt > 0 && socket->sent_handler != NULL)
+			socket->sent_handler(socket->rsock, p->cookie, p->delivered);
+		packet_put(socket, p);
 	}
+}
+
+/*
+ * rudp_unpack: Parse the header wh of a datagram of len bytes, whose
+ * payload has been read into p, into p.
+ * Returns -1 if the datagram is not a well-formed packet of our version.
+ */
+int rudp_unpack(struct rudp_wirehdr *wh, int len, struct rudp_packet *p) {
+	if(len < RUDP_HDRLEN)
+		return -1;
+	if(ntohs(wh->hdr.version) != RUDP_VERSION)
+		return -1;
+	// The advertised length must account for exactly the rest of the datagram
+	if(ntohs(wh->length) > RUDP_MAXMSS || RUDP_HDRLEN + ntohs(wh->length) != len)
+		return -1;
+	p->header.version = ntohs(wh->hdr.version);
+	p->header.type = ntohs(wh->hdr.type);
+	p->header.seqno = ntohl(wh->hdr.seqno);
+	p->header.flags = ntohs(wh->hdr.flags);
+	p->payload_length = ntohs(wh->length);
+	p->iovcnt = 0;
 	return 0;
 }
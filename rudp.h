@@ -1,11 +1,32 @@
 #ifndef RUDP_PROTO_H
 #define	RUDP_PROTO_H
 
-#define RUDP_VERSION	1	/* Protocol version */
-#define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a packet, RUDP header not included */
+#define RUDP_VERSION	4	/* Protocol version */
+#define RUDP_MAXPKTSIZE 1000	/* Default number of data bytes in a packet, RUDP header not included, which every path is assumed to carry */
+#define RUDP_MINMSS	512	/* Smallest payload size that can be set with RUDP_OPT_MSS, room for the largest SACK bitmap */
+#define RUDP_MAXMSS	8960	/* Largest payload size that can be set with RUDP_OPT_MSS, for a 9000-byte MTU */
+#define RUDP_PROBE_TRIES	3	/* Number of times a PMTU probe is sent before its size is given up on */
+#define RUDP_PROBE_STEP	16	/* PMTU probing stops when it is this many bytes from the largest size that works */
 #define RUDP_MAXRETRANS 5	/* Max. number of retransmissions */
-#define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds */
+#define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds, used until the RTT has been measured */
+#define RUDP_MINRTO	100	/* Default lower bound for the retransmission timeout in milliseconds */
+#define RUDP_MAXRTO	60000	/* Default upper bound for the retransmission timeout in milliseconds */
+#define RUDP_CLOCK_GRANULARITY	1000	/* Timer granularity in microseconds, the least variance added to the timeout */
 #define RUDP_WINDOW	3	/* Max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_MAXWINDOW	4096	/* Largest window that can be set with RUDP_OPT_WINDOW */
+#define RUDP_RECV_BATCH	64	/* Max. number of datagrams read per receive event */
+#define RUDP_SEND_BATCH	64	/* Max. number of datagrams sent with one system call */
+#define RUDP_ACK_EVERY	1	/* Default number of DATA packets received in order per ACK */
+#define RUDP_ACK_DELAY	40	/* Default max. time an ACK is held back in milliseconds */
+#define RUDP_MAXACKDELAY	500	/* Largest ACK delay that can be set with RUDP_OPT_ACK_DELAY */
+#define RUDP_STREAM_DELAY	5	/* Default max. time data of rudp_write is held back to fill a packet, in milliseconds */
+#define RUDP_MAXSTREAMDELAY	500	/* Largest delay that can be set with RUDP_OPT_STREAM_DELAY */
+#define RUDP_SNDBUF	256	/* Default max. number of packets queued per session, not counting the window */
+#define RUDP_SUBMIT_BUCKETS	64	/* Counts of the requests of other threads that wait, by peer, a power of two */
+#define RUDP_GROUP_REPAIRS	64	/* Repairs sent to a multicast group that are remembered, to suppress others, a power of two */
+#define RUDP_SESSION_TABLE	16	/* Initial size of the session table of a socket, a power of two */
+#define RUDP_SESSION_LINGER	10000	/* Time a finished session is kept, in milliseconds */
+#define RUDP_MAXFINISHED	1024	/* Max. number of finished sessions kept per socket */
 
 /* Packet types */
 
@@ -13,6 +34,17 @@
 #define RUDP_ACK	2
 #define RUDP_SYN	4
 #define RUDP_FIN	5
+#define RUDP_PROBE	6	/* Padded packet that tests if the path carries its size */
+#define RUDP_PROBEACK	7	/* Answer to a PROBE, with the same seqno */
+
+/* Flags of DATA packets */
+
+#define RUDP_FLAG_FIRST	0x01	/* First packet of a message */
+#define RUDP_FLAG_LAST	0x02	/* Last packet of a message */
+
+/* Flags of ACK packets */
+
+#define RUDP_FLAG_SYNACK	0x04	/* ACK of a SYN, with the receiver's MSS instead of a SACK bitmap */
 
 /*
  * Sequence numbers are 32-bit integers operated on with modular arithmetic.
@@ -30,6 +62,31 @@ struct rudp_hdr {
 	u_int16_t version;
 	u_int16_t type;
 	u_int32_t seqno;
+	u_int16_t flags;
+}__attribute__ ((packed));
+
+/*
+ * Wire format: the RUDP header, the payload length and then exactly
+ * length bytes of payload. All header fields are in network byte order.
+ */
+
+struct rudp_wirehdr {
+	struct rudp_hdr hdr;
+	u_int16_t length;	/* Number of payload bytes that follow */
 }__attribute__ ((packed));
 
+#define RUDP_HDRLEN	sizeof(struct rudp_wirehdr)
+
+/*
+ * The ACK of a SYN has RUDP_FLAG_SYNACK set and carries the largest payload
+ * the receiver accepts, as 16 bits in network byte order. Without it,
+ * RUDP_MAXPKTSIZE is assumed.
+ *
+ * An ACK acknowledges every packet with a lower sequence number than its
+ * own. Its payload may hold a selective-ack bitmap: bit i (least
+ * significant bit first) is set if packet seqno+1+i has been received.
+ */
+
+#define RUDP_SACK_BYTES(window)	(((window) + 7) / 8)
+
 #endif /* RUDP_PROTO_H */
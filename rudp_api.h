@@ -2,7 +2,12 @@
 #define	RUDP_API_H
 
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a
-				 * packet, RUDP header not included */
+				 * packet by default (RUDP_OPT_MSS), RUDP
+				 * header not included */
+#define RUDP_MAXIOV	4	/* Max. number of buffers of a packet sent
+				 * with rudp_sendv */
+#define RUDP_MAXMSGSIZE	(16 * 1024 * 1024)	/* Largest message that can be
+				 * sent with rudp_send_message */
 
 /*
  * Event types for callback notifications
@@ -11,8 +16,95 @@
 typedef enum {
 	RUDP_EVENT_TIMEOUT, 
 	RUDP_EVENT_CLOSED,
+	RUDP_EVENT_WRITABLE,	/* A send to the peer that failed with
+				 * EAGAIN may be tried again */
 } rudp_event_t; 
 
+/*
+ * Socket options
+ */
+
+typedef enum {
+	RUDP_OPT_WINDOW,	/* Max. number of unacknowledged packets per
+				 * session (1..RUDP_MAXWINDOW) */
+	RUDP_OPT_RTO_MIN,	/* Lower bound for the retransmission
+				 * timeout in milliseconds */
+	RUDP_OPT_RTO_MAX,	/* Upper bound for the retransmission
+				 * timeout in milliseconds */
+	RUDP_OPT_CC,		/* Congestion control algorithm, a
+				 * rudp_cc_t */
+	RUDP_OPT_ACK_EVERY,	/* Acknowledge every so many DATA packets
+				 * received in order (1 = every packet) */
+	RUDP_OPT_ACK_DELAY,	/* Max. time an ACK is held back in
+				 * milliseconds */
+	RUDP_OPT_RECV_LOAN,	/* If set, data passed to the receive
+				 * handler stays valid until rudp_release */
+	RUDP_OPT_MSS,		/* Largest payload sent or received in a
+				 * packet (RUDP_MINMSS..RUDP_MAXMSS), set
+				 * before the socket is used */
+	RUDP_OPT_PMTUD,		/* If set, sessions start at RUDP_MAXPKTSIZE
+				 * and probe the path for the largest
+				 * payload up to RUDP_OPT_MSS */
+	RUDP_OPT_STREAM_DELAY,	/* Max. time data of rudp_write is held
+				 * back to fill a packet in milliseconds,
+				 * 0 to send it at the end of each call */
+	RUDP_OPT_SNDBUF,	/* Max. number of packets queued per session
+				 * beyond the window, 0 for no limit */
+	RUDP_OPT_LOSS,		/* Percentage of the packets sent that are
+				 * dropped on purpose, to test recovery from
+				 * loss (0..100) */
+} rudp_option_t;
+
+/*
+ * Congestion control algorithms
+ */
+
+typedef enum {
+	RUDP_CC_NONE,		/* Only the window limits the sender */
+	RUDP_CC_RENO,		/* NewReno, loss-based (default) */
+	RUDP_CC_BBR,		/* BBR-lite, based on measured bandwidth
+				 * and RTT */
+} rudp_cc_t;
+
+/*
+ * Session state reported by rudp_getinfo
+ */
+
+struct rudp_info {
+	int window;		/* Window size */
+	int in_flight;		/* Packets sent but not yet acknowledged */
+	long srtt;		/* Smoothed round-trip time in microseconds,
+				 * 0 if not measured yet */
+	long rttvar;		/* Round-trip time variation in microseconds */
+	long rto;		/* Current retransmission timeout in microseconds */
+	int cwnd;		/* Congestion window in packets */
+	int mss;		/* Largest payload sent in a packet */
+};
+
+/*
+ * Log levels. Messages of the level set with rudp_log_level and all
+ * more severe levels are logged.
+ */
+
+typedef enum {
+	RUDP_LOG_NONE,		/* Nothing */
+	RUDP_LOG_ERROR,
+	RUDP_LOG_WARN,
+	RUDP_LOG_INFO,		/* Sessions that time out (default) */
+	RUDP_LOG_DEBUG,		/* Retransmissions and dropped packets */
+	RUDP_LOG_TRACE,		/* Every packet sent and received */
+} rudp_loglevel_t;
+
+/*
+ * Log categories, a mask of these selects what is logged
+ */
+
+#define RUDP_LOG_PACKET		0x01	/* Packets sent and received */
+#define RUDP_LOG_SESSION	0x02	/* Session state */
+#define RUDP_LOG_TIMER		0x04	/* Retransmission timeouts */
+#define RUDP_LOG_CC		0x08	/* Loss detection and recovery */
+#define RUDP_LOG_ALL		0xff
+
 /*
  * RUDP socket handle
  */
@@ -25,8 +117,12 @@ typedef void *rudp_socket_t;
 
 /* 
  * Socket creation 
+ * A socket is used by the thread that created it, whose event loop
+ * serves it. rudp_socket_reuseport opens one of several sockets on the
+ * same port, one per thread, among which the kernel spreads the peers.
  */
 rudp_socket_t rudp_socket(int port);
+rudp_socket_t rudp_socket_reuseport(int port);
 
 /* 
  * Socket termination
@@ -34,20 +130,103 @@ rudp_socket_t rudp_socket(int port);
 int rudp_close(rudp_socket_t rsocket);
 
 /* 
- * Send a datagram 
+ * Send a datagram of up to RUDP_OPT_MSS bytes
+ * The send functions return -1 with errno set to EAGAIN if the send
+ * buffer of the session is full (RUDP_OPT_SNDBUF). RUDP_EVENT_WRITABLE
+ * follows when it has been half emptied. A call that is accepted is
+ * queued whole, even if it takes the buffer over its limit.
  */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, 
 		struct sockaddr_in* to);
 
+/*
+ * Send a message of up to RUDP_MAXMSGSIZE bytes. It is split into as
+ * many packets as needed and passed to the receive handler of the peer
+ * in one piece.
+ */
+int rudp_send_message(rudp_socket_t rsocket, void *data, int len,
+		      struct sockaddr_in *to);
+
+/*
+ * Send a datagram to each of the npeers addresses in to. The data is
+ * copied once and shared by the packets to all of them. Fails with
+ * EAGAIN, sending nothing, if the send buffer of any of them is full.
+ */
+int rudp_sendto_group(rudp_socket_t rsocket, void *data, int len,
+		      struct sockaddr_in *to, int npeers);
+
+/*
+ * Multicast. After rudp_multicast, rudp_sendto_group sends each datagram
+ * once, to the group, out of the interface with address ifaddr (NULL for
+ * the one the routing table picks, which a host without a route for the
+ * group does not have; both calls fail then). The peers of its first
+ * call are the members of the group, and every later call must send to
+ * all of them and nothing else may be sent to them; datagrams hold at
+ * most RUDP_MAXPKTSIZE bytes, and a member whose MSS is smaller is
+ * refused with RUDP_EVENT_TIMEOUT. The members still open, acknowledge
+ * and close their sessions with the sender, which repairs losses to one
+ * peer alone and losses to several to the group.
+ * A receiver calls rudp_join_group to get the packets sent to the group.
+ */
+int rudp_multicast(rudp_socket_t rsocket, struct sockaddr_in *group,
+		   struct in_addr *ifaddr);
+int rudp_join_group(rudp_socket_t rsocket, struct sockaddr_in *group,
+		    struct in_addr *ifaddr);
+
+/*
+ * Write data to a byte stream to the peer. Writes are packed into
+ * packets of the session's MSS, which are sent when they are full, after
+ * RUDP_OPT_STREAM_DELAY, or on rudp_flush. The receive handler of the
+ * peer is passed the stream in pieces that need not match the writes.
+ */
+int rudp_write(rudp_socket_t rsocket, void *data, int len,
+	       struct sockaddr_in *to);
+int rudp_flush(rudp_socket_t rsocket, struct sockaddr_in *to);
+
+/*
+ * rudp_sendto and rudp_close for threads other than the one that serves
+ * the socket. The data is copied and the request is queued, without a
+ * lock, for the event loop of the socket, which carries the requests out
+ * in the order they were submitted. Sends to a peer whose send buffer is
+ * full wait there, while those to other peers go on, and
+ * rudp_submit_sendto fails with EAGAIN once RUDP_OPT_SNDBUF sends to the
+ * same peer are waiting (peers may share a count, by hash, of
+ * RUDP_SUBMIT_BUCKETS). Both fail once rudp_submit_close
+ * has been called on the socket, and a call that races with the loop
+ * freeing the socket either fails or is done before the socket is freed.
+ */
+int rudp_submit_sendto(rudp_socket_t rsocket, void *data, int len,
+		       struct sockaddr_in *to);
+int rudp_submit_close(rudp_socket_t rsocket);
+
+/*
+ * Send a datagram made of iovcnt buffers, e.g. a header and a payload,
+ * without copying them. The buffers must not be changed until the sent
+ * handler has been called with cookie; its last argument is 1 if the
+ * datagram was acknowledged and 0 if it was discarded with its session.
+ */
+int rudp_sendv(rudp_socket_t rsocket, const struct iovec *iov, int iovcnt,
+	       struct sockaddr_in *to, void *cookie);
+int rudp_sent_handler(rudp_socket_t rsocket,
+		      int (*handler)(rudp_socket_t, void *, int));
+
 /* 
  * Register callback function for packet receiption 
  * Note: data and len arguments to callback function 
- * are only valid during the call to the handler
+ * are only valid during the call to the handler, unless
+ * RUDP_OPT_RECV_LOAN is set
  */
 int rudp_recvfrom_handler(rudp_socket_t rsocket, 
 			  int (*handler)(rudp_socket_t, 
 					 struct sockaddr_in *, 
 					 char *, int));
+
+/*
+ * Give back data the receive handler was passed while RUDP_OPT_RECV_LOAN
+ * was set. Data that has not been given back when the socket is closed
+ * is freed with it.
+ */
+int rudp_release(rudp_socket_t rsocket, char *data);
 /*
  * Register callback handler for event notifications
  */
@@ -55,4 +234,28 @@ int rudp_event_handler(rudp_socket_t rsocket,
 		       int (*handler)(rudp_socket_t, 
 				      rudp_event_t, 
 				      struct sockaddr_in *));
+
+/*
+ * Set and get socket options. New values apply to sessions that
+ * are created after the call.
+ */
+int rudp_setsockopt(rudp_socket_t rsocket, rudp_option_t option, int value);
+int rudp_getsockopt(rudp_socket_t rsocket, rudp_option_t option, int *value);
+
+/*
+ * Get the state of the session we send to peer on
+ */
+int rudp_getinfo(rudp_socket_t rsocket, struct sockaddr_in *peer,
+		 struct rudp_info *info);
+
+/*
+ * Logging. Messages are kept in a ring buffer per thread and written to
+ * fd, as text or as binary records (see rudp_log.h), when it fills up,
+ * from a timer and when the thread ends; the rings of all threads are
+ * written at exit. rudp_log_flush writes those of the calling thread at
+ * once.
+ */
+void rudp_log_level(rudp_loglevel_t level, int mask);
+int rudp_log_output(int fd, int binary);
+void rudp_log_flush(void);
 #endif /* RUDP_API_H */
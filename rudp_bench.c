@@ -0,0 +1,252 @@
+/*
+ * rudp_bench: Loopback benchmark of RUDP. Sends a number of bytes from
+ * one RUDP socket to another in the same process, with a share of the
+ * packets in each direction dropped on purpose, and reports the
+ * throughput, and the packets passed per second of CPU time, which both
+ * sockets share. Used by "make bench" to compare the congestion control
+ * algorithms under loss, by "make bench-io" to compare batched and
+ * unbatched datagram I/O, and by "make bench-mt" to see how the total
+ * throughput grows with threads. With -t, each thread runs its own pair
+ * of sockets and event loop and sends the number of bytes.
+ */
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+#include "event.h"
+
+#define BENCH_PORT 45678		/* Default port of the receiving socket */
+#define BENCH_SIZE (4 * 1024 * 1024)	/* Default number of bytes sent */
+
+/*
+ * Prototypes
+ */
+
+int usage();
+void *bench(void *arg);
+int sendmore();
+int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+int receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+
+/*
+ * Global variables
+ */
+
+char *ccnames[] = { "none", "reno", "bbr" };	/* Indexed by rudp_cc_t */
+int cc = RUDP_CC_RENO;		/* Congestion control algorithm */
+int loss = 0;			/* Percentage of packets dropped */
+int window = 64;		/* RUDP window size */
+long size = BENCH_SIZE;		/* Bytes to send per thread */
+int threads = 1;		/* Threads, each with two sockets and an event loop */
+char data[RUDP_MAXPKTSIZE];	/* Payload of every packet */
+struct timeval start;		/* Time of the first send */
+pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;	/* Held to add to the totals */
+int done = 0;			/* Threads that have finished */
+long total_packets = 0;		/* Packets received by the threads that have finished */
+
+__thread long sent = 0;		/* Bytes passed to rudp_sendto */
+__thread long received = 0;	/* Bytes passed to the receive handler */
+__thread long packets = 0;	/* Times the receive handler was called */
+__thread rudp_socket_t txsock;	/* Sending socket */
+__thread struct sockaddr_in peer;	/* Address of the receiving socket */
+
+/*
+ * usage: how to use program
+ */
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_bench [-c none|reno|bbr] [-l loss] [-w window] [-s bytes] [-t threads] [-p port]\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	pthread_t thread;
+	int port = BENCH_PORT;
+	int c, i;
+
+	/*
+	 * Parse and collect arguments
+	 */
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "c:l:w:s:t:p:")) != -1) {
+		if (c == 'c') {
+			if (strcmp(optarg, "none") == 0)
+				cc = RUDP_CC_NONE;
+			else if (strcmp(optarg, "reno") == 0)
+				cc = RUDP_CC_RENO;
+			else if (strcmp(optarg, "bbr") == 0)
+				cc = RUDP_CC_BBR;
+			else
+				usage();
+		}
+		else if (c == 'l') {
+			loss = atoi(optarg);
+		}
+		else if (c == 'w') {
+			window = atoi(optarg);
+		}
+		else if (c == 's') {
+			size = atol(optarg);
+			if (size <= 0)
+				usage();
+		}
+		else if (c == 't') {
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+		}
+		else if (c == 'p') {
+			port = atoi(optarg);
+			if (port <= 0)
+				usage();
+		}
+		else
+			usage();
+	}
+	if (optind != argc)
+		usage();
+
+	/*
+	 * Thread i receives on port + i
+	 */
+
+	gettimeofday(&start, NULL);
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&thread, NULL, bench, (void *)(intptr_t)(port + i)) != 0) {
+			fprintf(stderr, "rudp_bench: pthread_create() failed\n");
+			exit(1);
+		}
+	}
+	bench((void *)(intptr_t)port);
+	return 0;
+}
+
+/*
+ * bench: Send size bytes from one socket to another on port, with a
+ * socket and event loop of this thread
+ */
+
+void *bench(void *arg) {
+	rudp_socket_t rxsock;
+	int port = (intptr_t)arg;
+
+	/*
+	 * Both sockets drop packets, so that DATA and ACKs are lost
+	 */
+
+	if ((rxsock = rudp_socket(port)) == NULL || (txsock = rudp_socket(0)) == NULL) {
+		fprintf(stderr, "rudp_bench: rudp_socket() failed\n");
+		exit(1);
+	}
+	if (rudp_setsockopt(rxsock, RUDP_OPT_WINDOW, window) < 0 ||
+	    rudp_setsockopt(txsock, RUDP_OPT_WINDOW, window) < 0 ||
+	    rudp_setsockopt(txsock, RUDP_OPT_CC, cc) < 0 ||
+	    rudp_setsockopt(rxsock, RUDP_OPT_LOSS, loss) < 0 ||
+	    rudp_setsockopt(txsock, RUDP_OPT_LOSS, loss) < 0) {
+		exit(1);
+	}
+	rudp_recvfrom_handler(rxsock, receiver);
+	rudp_event_handler(txsock, eventhandler);
+
+	memset(&peer, 0, sizeof(peer));
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(port);
+	peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sendmore();
+	eventloop(0);
+	return NULL;
+}
+
+/*
+ * sendmore: Send until the send buffer is full or all bytes have been
+ * sent, and close the socket then
+ */
+
+int sendmore() {
+	int len;
+
+	while (sent < size) {
+		len = size - sent < RUDP_MAXPKTSIZE ? size - sent : RUDP_MAXPKTSIZE;
+		if (rudp_sendto(txsock, data, len, &peer) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			fprintf(stderr, "rudp_bench: send failure\n");
+			exit(1);
+		}
+		sent += len;
+	}
+	rudp_close(txsock);
+	return 0;
+}
+
+/*
+ * eventhandler: callback function for RUDP events of the sending
+ * socket. It is closed when the last packet has been acknowledged, and
+ * the results are printed when that has happened in every thread.
+ */
+
+int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+	struct timeval now, elapsed;
+	struct rusage ru;
+	double secs, cpu;
+
+	switch (event) {
+	case RUDP_EVENT_TIMEOUT:
+		fprintf(stderr, "rudp_bench: %s loss %d%%: time out\n", ccnames[cc], loss);
+		exit(1);
+		break;
+	case RUDP_EVENT_CLOSED:
+		if (received != size) {
+			fprintf(stderr, "rudp_bench: %ld of %ld bytes received\n", received, size);
+			exit(1);
+		}
+		pthread_mutex_lock(&done_lock);
+		total_packets += packets;
+		if (++done < threads) {
+			pthread_mutex_unlock(&done_lock);
+			break;
+		}
+		gettimeofday(&now, NULL);
+		timersub(&now, &start, &elapsed);
+		secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+		getrusage(RUSAGE_SELF, &ru);
+		timeradd(&ru.ru_utime, &ru.ru_stime, &elapsed);
+		cpu = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+		printf("%-4s loss %2d%%", ccnames[cc], loss);
+		if (threads > 1)
+			printf(", %d threads", threads);
+		printf(": %ld bytes in %.3f s, %.2f MB/s, %.0f packets/s per core\n",
+		       size * threads, secs, size * threads / secs / (1024 * 1024),
+		       cpu > 0 ? total_packets / cpu : 0);
+		exit(0);
+		break;
+	case RUDP_EVENT_WRITABLE:
+		sendmore();
+		break;
+	}
+	return 0;
+}
+
+/*
+ * receiver: callback function for data received by the receiving socket
+ */
+
+int receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+	received += len;
+	packets++;
+	return 0;
+}
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "rudp.h"
+#include "rudp_cc.h"
+
+// Prototypes
+void none_init(struct rudp_cc *cc);
+void none_ack(struct rudp_cc *cc, int acked, long rtt);
+void none_loss(struct rudp_cc *cc, int in_flight);
+void reno_init(struct rudp_cc *cc);
+void reno_ack(struct rudp_cc *cc, int acked, long rtt);
+void reno_loss(struct rudp_cc *cc, int in_flight);
+void reno_timeout(struct rudp_cc *cc, int in_flight);
+void bbr_init(struct rudp_cc *cc);
+void bbr_ack(struct rudp_cc *cc, int acked, long rtt);
+void bbr_timeout(struct rudp_cc *cc, int in_flight);
+
+/*
+ * Algorithms, indexed by rudp_cc_t
+ */
+struct rudp_cc_ops cc_algorithms[] = {
+	{ "none", none_init, none_ack, none_loss, none_loss },
+	{ "reno", reno_init, reno_ack, reno_loss, reno_timeout },
+	{ "bbr", bbr_init, bbr_ack, none_loss, bbr_timeout },
+};
+
+#define CC_ALGORITHMS	(sizeof(cc_algorithms) / sizeof(cc_algorithms[0]))
+
+/*
+ * rudp_cc_init: Start congestion control with algorithm for a new session.
+ * Returns -1 if there is no such algorithm.
+ */
+int rudp_cc_init(struct rudp_cc *cc, int algorithm) {
+	if(algorithm < 0 || algorithm >= (int)CC_ALGORITHMS)
+		return -1;
+	bzero(cc, sizeof(struct rudp_cc));
+	cc->ops = &cc_algorithms[algorithm];
+	cc->ops->init(cc);
+	return 0;
+}
+
+void rudp_cc_ack(struct rudp_cc *cc, int acked, long rtt) {
+	cc->ops->ack(cc, acked, rtt);
+}
+
+void rudp_cc_loss(struct rudp_cc *cc, int in_flight) {
+	cc->ops->loss(cc, in_flight);
+}
+
+void rudp_cc_timeout(struct rudp_cc *cc, int in_flight) {
+	cc->ops->timeout(cc, in_flight);
+}
+
+/*
+ * rudp_cc_window: Number of packets the session may have in flight.
+ */
+int rudp_cc_window(struct rudp_cc *cc) {
+	if(cc->cwnd < 1)
+		return 1;
+	return (int)cc->cwnd;
+}
+
+/*
+ * none: No congestion control, only the sliding window limits the sender.
+ */
+void none_init(struct rudp_cc *cc) {
+	cc->cwnd = RUDP_MAXWINDOW;
+}
+
+void none_ack(struct rudp_cc *cc, int acked, long rtt) {
+}
+
+void none_loss(struct rudp_cc *cc, int in_flight) {
+}
+
+/*
+ * reno: NewReno (RFC 5681, RFC 6582). Slow start doubles cwnd every round
+ * trip up to ssthresh, after which it grows by one packet per round trip.
+ * A loss halves it, and a timeout starts over from one packet.
+ */
+void reno_init(struct rudp_cc *cc) {
+	cc->cwnd = RUDP_CC_INITCWND;
+	cc->ssthresh = RUDP_MAXWINDOW;
+}
+
+void reno_ack(struct rudp_cc *cc, int acked, long rtt) {
+	// Do not grow while the lost packets are being retransmitted
+	if(cc->in_recovery)
+		return;
+	if(cc->cwnd < cc->ssthresh)
+		cc->cwnd += acked;
+	else
+		cc->cwnd += (double)acked / cc->cwnd;
+}
+
+void reno_loss(struct rudp_cc *cc, int in_flight) {
+	cc->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+	cc->cwnd = cc->ssthresh;
+}
+
+void reno_timeout(struct rudp_cc *cc, int in_flight) {
+	cc->ssthresh = in_flight / 2 > 2 ? in_flight / 2 : 2;
+	cc->cwnd = 1;
+}
+
+/*
+ * bbr: BBR-lite. Estimates the bottleneck bandwidth as the highest delivery
+ * rate of recent rounds and the propagation delay as the least RTT seen,
+ * and keeps cwnd at twice their product. Random loss does not shrink the
+ * window. Startup grows cwnd like slow start until the bandwidth has
+ * stopped growing by 25% for three rounds. There is no pacing, so the
+ * window is the only limit on the sending rate.
+ */
+void bbr_init(struct rudp_cc *cc) {
+	cc->cwnd = RUDP_CC_INITCWND;
+}
+
+void bbr_ack(struct rudp_cc *cc, int acked, long rtt) {
+	struct timeval now, elapsed;
+	gettimeofday(&now, NULL);
+
+	if(rtt > 0) {
+		timersub(&now, &cc->min_rtt_time, &elapsed);
+		if(cc->min_rtt == 0 || rtt <= cc->min_rtt || elapsed.tv_sec * 1000000L + elapsed.tv_usec > RUDP_CC_MINRTT_WIN) {
+			cc->min_rtt = rtt;
+			cc->min_rtt_time = now;
+		}
+	}
+
+	if(!timerisset(&cc->round_start))
+		cc->round_start = now;
+	cc->round_delivered += acked;
+
+	// A round lasts one min. RTT; its delivery rate is a bandwidth sample
+	timersub(&now, &cc->round_start, &elapsed);
+	long usec = elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+	if(cc->min_rtt > 0 && usec >= cc->min_rtt) {
+		int i;
+		cc->bw[cc->round % RUDP_CC_BW_ROUNDS] = (double)cc->round_delivered / usec;
+		cc->round++;
+		cc->max_bw = 0;
+		for(i = 0; i < RUDP_CC_BW_ROUNDS; i++) {
+			if(cc->bw[i] > cc->max_bw)
+				cc->max_bw = cc->bw[i];
+		}
+		cc->round_start = now;
+		cc->round_delivered = 0;
+
+		if(!cc->filled_pipe) {
+			if(cc->max_bw >= cc->full_bw * 1.25) {
+				cc->full_bw = cc->max_bw;
+				cc->full_bw_rounds = 0;
+			}
+			else if(++cc->full_bw_rounds >= 3)
+				cc->filled_pipe = 1;
+		}
+	}
+
+	if(cc->filled_pipe) {
+		cc->cwnd = 2 * cc->max_bw * cc->min_rtt;
+		if(cc->cwnd < RUDP_CC_MINCWND)
+			cc->cwnd = RUDP_CC_MINCWND;
+	}
+	else
+		cc->cwnd += acked;
+	if(cc->cwnd > RUDP_MAXWINDOW)
+		cc->cwnd = RUDP_MAXWINDOW;
+}
+
+void bbr_timeout(struct rudp_cc *cc, int in_flight) {
+	// The model is kept; the next ACK restores cwnd from it
+	cc->cwnd = RUDP_CC_MINCWND;
+}
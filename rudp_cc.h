@@ -0,0 +1,63 @@
+#ifndef RUDP_CC_H
+#define	RUDP_CC_H
+
+/*
+ * Congestion control. Every sender session has a congestion window (cwnd),
+ * counted in packets, that limits how many packets it may have in flight
+ * on top of the sliding window. The algorithm that maintains it is chosen
+ * per socket with RUDP_OPT_CC.
+ */
+
+#define RUDP_CC_INITCWND	4	/* Initial congestion window */
+#define RUDP_CC_MINCWND	4	/* Congestion window of BBR-lite after a timeout */
+#define RUDP_CC_DUPACKS	3	/* Duplicate ACKs that signal a lost packet */
+#define RUDP_CC_BW_ROUNDS	10	/* Rounds the bandwidth estimate of BBR-lite is kept for */
+#define RUDP_CC_MINRTT_WIN	10000000	/* Lifetime of the min. RTT estimate in microseconds */
+
+struct rudp_cc;
+
+/*
+ * Operations of a congestion control algorithm
+ */
+
+struct rudp_cc_ops {
+	char *name;
+	void (*init)(struct rudp_cc *cc);
+	/* acked packets were newly acknowledged; rtt is a sample in microseconds, or 0 */
+	void (*ack)(struct rudp_cc *cc, int acked, long rtt);
+	/* Duplicate ACKs indicate that a packet was lost */
+	void (*loss)(struct rudp_cc *cc, int in_flight);
+	/* A retransmission timer has expired */
+	void (*timeout)(struct rudp_cc *cc, int in_flight);
+};
+
+struct rudp_cc {
+	struct rudp_cc_ops *ops;
+	int in_recovery;	/* Set by the caller while retransmitting after a loss */
+	double cwnd;		/* Congestion window in packets */
+	double ssthresh;	/* Slow start threshold (Reno) */
+
+	/* BBR-lite: a model of the path's bandwidth and round-trip time */
+	long min_rtt;		/* Least RTT seen in microseconds, 0 if not measured */
+	struct timeval min_rtt_time;	/* When min_rtt was measured */
+	double bw[RUDP_CC_BW_ROUNDS];	/* Delivery rate of recent rounds in packets/microsecond */
+	double max_bw;		/* Bottleneck bandwidth estimate, the max. of bw */
+	int round;		/* Number of rounds measured */
+	struct timeval round_start;	/* Start of the current round */
+	int round_delivered;	/* Packets acknowledged in the current round */
+	double full_bw;		/* Bandwidth when startup last saw it grow */
+	int full_bw_rounds;	/* Rounds since then */
+	int filled_pipe;	/* Has startup ended? */
+};
+
+/*
+ * Prototypes
+ */
+
+int rudp_cc_init(struct rudp_cc *cc, int algorithm);
+void rudp_cc_ack(struct rudp_cc *cc, int acked, long rtt);
+void rudp_cc_loss(struct rudp_cc *cc, int in_flight);
+void rudp_cc_timeout(struct rudp_cc *cc, int in_flight);
+int rudp_cc_window(struct rudp_cc *cc);
+
+#endif /* RUDP_CC_H */
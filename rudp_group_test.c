@@ -0,0 +1,168 @@
+/*
+ * rudp_group_test: Loopback test of the members of a multicast group.
+ * One RUDP socket sends packets of RUDP_MAXPKTSIZE bytes to a group
+ * that two others in the same process have joined. With -s, the second
+ * member accepts only mss bytes (RUDP_OPT_MSS); the sender must then
+ * refuse it before anything is sent to the group, rather than send it
+ * packets it cannot read. Used by "make test".
+ */
+
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "rudp_api.h"
+#include "event.h"
+
+#define TEST_PORT 45690		/* Default port of the first member */
+#define TEST_PACKETS 50		/* Packets sent to the group */
+
+/*
+ * Prototypes
+ */
+
+int usage();
+int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
+int receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
+
+/*
+ * Global variables
+ */
+
+int mss = 0;			/* RUDP_OPT_MSS of the second member, 0 for default */
+rudp_socket_t rxsock[2];	/* Members */
+long received[2];		/* Bytes passed to the receive handler of each */
+struct sockaddr_in peers[2];	/* Addresses of the members */
+
+/*
+ * usage: how to use program
+ */
+
+int usage() {
+	fprintf(stderr, "Usage: rudp_group_test [-s mss] [-p port]\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	rudp_socket_t txsock;
+	struct sockaddr_in group;
+	struct in_addr ifaddr;
+	char data[RUDP_MAXPKTSIZE];
+	int port = TEST_PORT;
+	int c, i;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "s:p:")) != -1) {
+		if (c == 's') {
+			mss = atoi(optarg);
+		}
+		else if (c == 'p') {
+			port = atoi(optarg);
+			if (port <= 0)
+				usage();
+		}
+		else
+			usage();
+	}
+	if (optind != argc)
+		usage();
+
+	/*
+	 * The group is joined and sent to on the loopback interface
+	 */
+
+	ifaddr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&group, 0, sizeof(group));
+	group.sin_family = AF_INET;
+	group.sin_port = htons(port + 2);
+	inet_aton("239.255.7.9", &group.sin_addr);
+
+	for (i = 0; i < 2; i++) {
+		if ((rxsock[i] = rudp_socket(port + i)) == NULL) {
+			fprintf(stderr, "rudp_group_test: rudp_socket() failed\n");
+			exit(1);
+		}
+		if ((i == 1 && mss > 0 && rudp_setsockopt(rxsock[i], RUDP_OPT_MSS, mss) < 0) ||
+		    rudp_join_group(rxsock[i], &group, &ifaddr) < 0) {
+			exit(1);
+		}
+		rudp_recvfrom_handler(rxsock[i], receiver);
+		memset(&peers[i], 0, sizeof(peers[i]));
+		peers[i].sin_family = AF_INET;
+		peers[i].sin_port = htons(port + i);
+		peers[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	if ((txsock = rudp_socket(0)) == NULL) {
+		fprintf(stderr, "rudp_group_test: rudp_socket() failed\n");
+		exit(1);
+	}
+	if (rudp_setsockopt(txsock, RUDP_OPT_SNDBUF, 0) < 0 ||
+	    rudp_multicast(txsock, &group, &ifaddr) < 0) {
+		exit(1);
+	}
+	rudp_event_handler(txsock, eventhandler);
+
+	memset(data, 'x', sizeof(data));
+	for (i = 0; i < TEST_PACKETS; i++) {
+		if (rudp_sendto_group(txsock, data, sizeof(data), peers, 2) < 0) {
+			fprintf(stderr, "rudp_group_test: send failure\n");
+			exit(1);
+		}
+	}
+	rudp_close(txsock);
+	eventloop(0);
+	return 0;
+}
+
+/*
+ * eventhandler: callback function for RUDP events of the sending
+ * socket. Checks what the members have received when it is closed, or
+ * when a member is refused.
+ */
+
+int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+	switch (event) {
+	case RUDP_EVENT_TIMEOUT:
+		if (mss > 0 && mss < RUDP_MAXPKTSIZE && remote != NULL &&
+		    remote->sin_port == peers[1].sin_port && received[0] == 0 && received[1] == 0) {
+			printf("rudp_group_test: member with MSS %d refused\n", mss);
+			exit(0);
+		}
+		fprintf(stderr, "rudp_group_test: time out, %ld and %ld bytes received\n", received[0], received[1]);
+		exit(1);
+		break;
+	case RUDP_EVENT_CLOSED:
+		if (mss > 0 && mss < RUDP_MAXPKTSIZE) {
+			fprintf(stderr, "rudp_group_test: member with MSS %d was not refused\n", mss);
+			exit(1);
+		}
+		if (received[0] != TEST_PACKETS * RUDP_MAXPKTSIZE || received[1] != TEST_PACKETS * RUDP_MAXPKTSIZE) {
+			fprintf(stderr, "rudp_group_test: %ld and %ld of %d bytes received\n",
+				received[0], received[1], TEST_PACKETS * RUDP_MAXPKTSIZE);
+			exit(1);
+		}
+		printf("rudp_group_test: %d packets received by both members\n", TEST_PACKETS);
+		exit(0);
+		break;
+	case RUDP_EVENT_WRITABLE:
+		break;
+	}
+	return 0;
+}
+
+/*
+ * receiver: callback function for data received by the members
+ */
+
+int receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len) {
+	received[rsocket == rxsock[0] ? 0 : 1] += len;
+	return 0;
+}
@@ -0,0 +1,351 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "event.h"
+#include "rudp.h"
+#include "rudp_api.h"
+#include "rudp_log.h"
+
+// Prototypes
+int log_timer(int fd, void *arg);
+int log_write(char *buf, int len);
+int log_format(struct rudp_log_record *r, char *buf, int size);
+void log_exit(void);
+void log_thread_exit(void *arg);
+struct log_ring *log_ring_get(void);
+void log_flush_ring(struct log_ring *ring);
+void log_add(struct rudp_log_record *r, char *buf, int size, int *len);
+
+/*
+ * Formats of the events, indexed by event number. %t is a packet type,
+ * %a an address and port (two arguments).
+ */
+char *log_formats[] = {
+	"send %t to %a seq=%u socket=%d",
+	"resend %t to %a seq=%u socket=%d",
+	"recv %t from %a seq=%u socket=%d",
+	"drop %t to %a seq=%u",
+	"malformed packet (%d bytes) from %a",
+	"fast retransmit seq=%u to %a cwnd=%d",
+	"%t seq=%u to %a timed out",
+	"%d messages lost",
+};
+
+#define LOG_EVENTS	(sizeof(log_formats) / sizeof(log_formats[0]))
+
+char *log_levels[] = { "none", "error", "warn", "info", "debug", "trace" };
+
+rudp_loglevel_t rudp_loglevel = RUDP_LOG_INFO;
+int rudp_logmask = RUDP_LOG_ALL;
+
+/*
+ * The rings. Every thread logs to a ring of its own, which is flushed by
+ * a timer of its event loop, so threads that run event loops of their
+ * own do not share one. The rings of all threads are on a list, so that
+ * the thread that exits the process flushes them all; a thread that ends
+ * before flushes its own. Only the thread that logs moves head, and a
+ * flush, by that thread or at exit, moves tail under the ring's lock, so
+ * logging takes no lock.
+ */
+struct log_ring {
+	struct rudp_log_record records[RUDP_LOG_RING];
+	unsigned int head; // Next record to fill
+	unsigned int tail; // Next record to write
+	u_int32_t lost; // Records dropped because the ring was full
+	int timer_set; // Is a flush timer set in the thread's event loop?
+	pthread_mutex_t lock; // Held while the ring is flushed
+	struct log_ring *next; // Next ring on log_rings
+};
+
+__thread struct log_ring *log_self = NULL; // Ring of this thread, NULL until it logs
+struct log_ring *log_rings = NULL; // Rings of all threads that have logged
+pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER; // Held to change or walk log_rings
+pthread_key_t log_key; // Calls log_thread_exit with the ring of a thread that ends
+int log_fd = 1;
+int log_binary = 0;
+int log_atexit = 0;
+
+void rudp_log_level(rudp_loglevel_t level, int mask) {
+	rudp_loglevel = level;
+	rudp_logmask = mask;
+}
+
+/*
+ * rudp_log_output: Write log records to fd, as binary records if binary
+ * is set. Records already in the ring go to the old fd first.
+ */
+int rudp_log_output(int fd, int binary) {
+	if(fd < 0) {
+		fprintf(stderr, "rudp_log_output: Invalid file descriptor %d\n", fd);
+		return -1;
+	}
+	log_exit();
+	log_fd = fd;
+	log_binary = binary;
+	return 0;
+}
+
+/*
+ * rudp_log: Add a record to the ring. Use RUDP_LOG, which does not
+ * evaluate the arguments of disabled messages.
+ */
+void rudp_log(int level, int category, int event, u_int32_t a0, u_int32_t a1,
+	      u_int32_t a2, u_int32_t a3, u_int32_t a4) {
+	struct log_ring *ring = log_ring_get();
+	if(ring == NULL)
+		return;
+	unsigned int head = ring->head;
+	unsigned int used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if(used >= RUDP_LOG_RING * 3 / 4) {
+		log_flush_ring(ring);
+		used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	}
+	if(used >= RUDP_LOG_RING) {
+		__atomic_fetch_add(&ring->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct rudp_log_record *r = &ring->records[head & (RUDP_LOG_RING - 1)];
+	gettimeofday(&r->time, NULL);
+	r->level = level;
+	r->category = category;
+	r->event = event;
+	r->arg[0] = a0;
+	r->arg[1] = a1;
+	r->arg[2] = a2;
+	r->arg[3] = a3;
+	r->arg[4] = a4;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if(!ring->timer_set) {
+		struct timeval now, delay, when;
+		gettimeofday(&now, NULL);
+		delay.tv_sec = RUDP_LOG_FLUSH / 1000;
+		delay.tv_usec = (RUDP_LOG_FLUSH % 1000) * 1000;
+		timeradd(&now, &delay, &when);
+		if(event_timer(when, log_timer, NULL, "rudp log flush") != EVENT_TIMER_NONE)
+			ring->timer_set = 1;
+	}
+}
+
+/*
+ * log_ring_get: The ring of the calling thread, which is created and put
+ * on log_rings when the thread first logs. NULL if there is no memory.
+ */
+struct log_ring *log_ring_get(void) {
+	if(log_self != NULL)
+		return log_self;
+
+	struct log_ring *ring = malloc(sizeof(struct log_ring));
+	if(ring == NULL)
+		return NULL;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->lost = 0;
+	ring->timer_set = 0;
+	pthread_mutex_init(&ring->lock, NULL);
+
+	pthread_mutex_lock(&log_rings_lock);
+	if(!log_atexit) {
+		pthread_key_create(&log_key, log_thread_exit);
+		atexit(log_exit);
+		log_atexit = 1;
+	}
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_rings_lock);
+	pthread_setspecific(log_key, ring);
+	log_self = ring;
+	return ring;
+}
+
+/*
+ * rudp_log_flush: Write all records in the ring of the calling thread.
+ */
+void rudp_log_flush(void) {
+	if(log_self != NULL)
+		log_flush_ring(log_self);
+}
+
+/*
+ * log_flush_ring: Write all records in a ring, which may be another
+ * thread's.
+ */
+void log_flush_ring(struct log_ring *ring) {
+	char buf[8192];
+	int len = 0;
+
+	pthread_mutex_lock(&ring->lock);
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	for(; tail != head; tail++)
+		log_add(&ring->records[tail & (RUDP_LOG_RING - 1)], buf, sizeof(buf), &len);
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	// Records that did not fit are reported after those that did
+	u_int32_t lost_count = __atomic_exchange_n(&ring->lost, 0, __ATOMIC_RELAXED);
+	if(lost_count > 0) {
+		struct rudp_log_record lost;
+		bzero(&lost, sizeof(lost));
+		gettimeofday(&lost.time, NULL);
+		lost.level = RUDP_LOG_WARN;
+		lost.event = RUDP_LOGEV_LOST;
+		lost.arg[0] = lost_count;
+		log_add(&lost, buf, sizeof(buf), &len);
+	}
+	if(len > 0)
+		log_write(buf, len);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * log_add: Add a record to the output in buf, which holds *len of size
+ * bytes, writing buf out first if it is full.
+ */
+void log_add(struct rudp_log_record *r, char *buf, int size, int *len) {
+	char line[256];
+	char *out = line;
+	int n;
+
+	if(log_binary) {
+		out = (char *)r;
+		n = sizeof(struct rudp_log_record);
+	}
+	else
+		n = log_format(r, line, sizeof(line));
+	if(*len + n > size) {
+		log_write(buf, *len);
+		*len = 0;
+	}
+	memcpy(buf + *len, out, n);
+	*len += n;
+}
+
+int log_timer(int fd, void *arg) {
+	if(log_self != NULL)
+		log_self->timer_set = 0;
+	rudp_log_flush();
+	return 0;
+}
+
+/*
+ * log_exit: Write the records in the rings of all threads, at exit and
+ * when the output changes.
+ */
+void log_exit(void) {
+	struct log_ring *ring;
+	pthread_mutex_lock(&log_rings_lock);
+	for(ring = log_rings; ring != NULL; ring = ring->next)
+		log_flush_ring(ring);
+	pthread_mutex_unlock(&log_rings_lock);
+}
+
+/*
+ * log_thread_exit: Write the records in the ring of a thread that ends,
+ * and free it.
+ */
+void log_thread_exit(void *arg) {
+	struct log_ring *ring = arg, **pp;
+	log_flush_ring(ring);
+	pthread_mutex_lock(&log_rings_lock);
+	for(pp = &log_rings; *pp != NULL; pp = &(*pp)->next) {
+		if(*pp == ring) {
+			*pp = ring->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+	log_self = NULL;
+}
+
+/*
+ * log_write: Write len bytes of buf to the log.
+ */
+int log_write(char *buf, int len) {
+	while(len > 0) {
+		int n = write(log_fd, buf, len);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * log_format: Format a record as a line of text in buf. Returns its length.
+ */
+int log_format(struct rudp_log_record *r, char *buf, int size) {
+	int len = 0;
+	int arg = 0;
+	char *f;
+
+	len += snprintf(buf, size, "%ld.%06ld %s ", (long)r->time.tv_sec, (long)r->time.tv_usec,
+		       r->level < sizeof(log_levels) / sizeof(log_levels[0]) ? log_levels[r->level] : "?");
+	if(r->event >= LOG_EVENTS) {
+		len += snprintf(buf + len, size - len, "event %d\n", r->event);
+		return len;
+	}
+
+	for(f = log_formats[r->event]; *f != '\0' && len < size - 1; f++) {
+		if(*f != '%' || f[1] == '\0' || arg >= RUDP_LOG_ARGS) {
+			buf[len++] = *f;
+			continue;
+		}
+		u_int32_t a = r->arg[arg++];
+		switch(*++f) {
+		case 't':
+			if(a == RUDP_DATA)
+				len += snprintf(buf + len, size - len, "DATA");
+			else if(a == RUDP_ACK)
+				len += snprintf(buf + len, size - len, "ACK");
+			else if(a == RUDP_SYN)
+				len += snprintf(buf + len, size - len, "SYN");
+			else if(a == RUDP_FIN)
+				len += snprintf(buf + len, size - len, "FIN");
+			else if(a == RUDP_PROBE)
+				len += snprintf(buf + len, size - len, "PROBE");
+			else if(a == RUDP_PROBEACK)
+				len += snprintf(buf + len, size - len, "PROBEACK");
+			else
+				len += snprintf(buf + len, size - len, "BAD");
+			break;
+		case 'a': {
+			struct in_addr addr;
+			addr.s_addr = a;
+			len += snprintf(buf + len, size - len, "%s:%d", inet_ntoa(addr),
+				       arg < RUDP_LOG_ARGS ? ntohs(r->arg[arg++]) : 0);
+			break;
+		}
+		case 'd':
+			len += snprintf(buf + len, size - len, "%d", (int)a);
+			break;
+		default:
+			len += snprintf(buf + len, size - len, "%u", a);
+			break;
+		}
+		if(len > size - 2)
+			len = size - 2;
+	}
+	if(len > size - 2)
+		len = size - 2;
+	buf[len++] = '\n';
+	buf[len] = '\0';
+	return len;
+}
@@ -0,0 +1,74 @@
+#ifndef RUDP_LOG_H
+#define	RUDP_LOG_H
+
+/*
+ * Logging. A message is a binary record of an event number and a few
+ * integer arguments that is added to a ring buffer of the calling thread,
+ * so logging a packet does not format anything, take a lock or make a
+ * system call. A ring is written out when it is three quarters full,
+ * RUDP_LOG_FLUSH milliseconds after the first message since the last
+ * flush, and when its thread ends; the rings of all threads are written
+ * at exit. In text mode, the
+ * events' formats are applied then; in binary mode, the records are
+ * written as they are.
+ *
+ * Levels above RUDP_LOG_MAXLEVEL are compiled out, e.g. with
+ * -DRUDP_LOG_MAXLEVEL=RUDP_LOG_INFO. The others cost a compare when they
+ * are disabled.
+ */
+
+#ifndef RUDP_LOG_MAXLEVEL
+#define RUDP_LOG_MAXLEVEL	RUDP_LOG_TRACE
+#endif
+
+#define RUDP_LOG_RING	4096	/* Records in the ring, a power of two */
+#define RUDP_LOG_FLUSH	100	/* Max. delay before records are written, in milliseconds */
+#define RUDP_LOG_ARGS	5	/* Arguments per record */
+
+/*
+ * Events. Their formats are in rudp_log.c.
+ */
+
+enum {
+	RUDP_LOGEV_SEND,	/* type, address, port, seqno, socket */
+	RUDP_LOGEV_RESEND,	/* type, address, port, seqno, socket */
+	RUDP_LOGEV_RECV,	/* type, address, port, seqno, socket */
+	RUDP_LOGEV_DROP,	/* type, address, port, seqno */
+	RUDP_LOGEV_MALFORMED,	/* length, address, port */
+	RUDP_LOGEV_FASTRETRANS,	/* seqno, address, port, cwnd */
+	RUDP_LOGEV_TIMEOUT,	/* type, seqno, address, port */
+	RUDP_LOGEV_LOST,	/* number of records that did not fit in the ring */
+};
+
+/*
+ * A binary record. Addresses and ports are in network byte order.
+ */
+
+struct rudp_log_record {
+	struct timeval time;
+	u_int8_t level;
+	u_int8_t category;
+	u_int16_t event;
+	u_int32_t arg[RUDP_LOG_ARGS];
+};
+
+extern rudp_loglevel_t rudp_loglevel;
+extern int rudp_logmask;
+
+#define RUDP_LOG_ON(level, category) \
+	((level) <= RUDP_LOG_MAXLEVEL && (level) <= rudp_loglevel && (rudp_logmask & (category)))
+
+#define RUDP_LOG(level, category, event, a0, a1, a2, a3, a4) \
+	do { \
+		if(RUDP_LOG_ON(level, category)) \
+			rudp_log(level, category, event, a0, a1, a2, a3, a4); \
+	} while(0)
+
+/*
+ * Prototypes
+ */
+
+void rudp_log(int level, int category, int event, u_int32_t a0, u_int32_t a1,
+	      u_int32_t a2, u_int32_t a3, u_int32_t a4);
+
+#endif /* RUDP_LOG_H */
@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <syslog.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
@@ -20,6 +22,7 @@
 #include "event.h" 
 #include "vsftp.h"
 
+#define VS_WRITEBEHIND (256 * 1024)	/* Bytes of DATA collected for one write */
 
 /*
  * Data structure for keeping track of partially received files 
@@ -31,6 +34,9 @@ struct rxfile {
 	int fd;				/* File descriptor */
 	struct sockaddr_in remote;	/* Peer */
 	char name[VS_FILENAMELENGTH+1]; /* Name of file */
+	char *buf;			/* DATA not written yet */
+	off_t bufoff;			/* Offset in the file of its first byte */
+	int buflen;			/* Bytes in it */
 
 };
 
@@ -39,40 +45,98 @@ struct rxfile {
  */
 
 int filesender(int fd, void *arg);
+static int rxwrite(struct rxfile *rx, off_t offset, void *data, int len);
+static int rxflush(struct rxfile *rx);
+void *receiver(void *arg);
 int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf, int len);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 int usage();
+int parse_group(char *arg, struct sockaddr_in *group);
 
 /* 
  * Global variables 
  */
 int debug = 0;				/* Print debug messages */
-struct rxfile *rxhead = NULL;		/* Pointer to linked list of rxfiles */
+int window = 0;				/* RUDP window size, 0 for default */
+int ack_every = 0;			/* Packets per ACK, 0 for default */
+int loss = 0;				/* Percentage of packets dropped, for testing */
+int mss = 0;				/* Largest payload accepted, 0 for default */
+int threads = 1;			/* Receiving threads, each with a socket and event loop */
+struct sockaddr_in group;		/* Multicast group to join, sin_family 0 if none */
+struct in_addr ifaddr;			/* Interface to join it on */
+struct in_addr *ifaddrp = NULL;		/* &ifaddr if one was given */
+__thread struct rxfile *rxhead = NULL;	/* Pointer to linked list of rxfiles of this thread */
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_recv [-d] port\n");
+	fprintf(stderr, "Usage: vs_recv [-d] [-w window] [-a packets] [-l loss] [-s mss] [-t threads] [-m group:port [-I ifaddr]] port\n");
+	fprintf(stderr, "  -I gives the interface of the group, e.g. 127.0.0.1 on one host; it is needed if there is no route for the group\n");
 	exit(1);
 }
 
+/*
+ * parse_group: Parse a multicast group given as address:port
+ */
+
+int parse_group(char *arg, struct sockaddr_in *group) {
+	char *colon = strchr(arg, ':');
+
+	if (colon == NULL || atoi(colon + 1) <= 0)
+		return -1;
+	*colon = '\0';
+	memset(group, 0, sizeof(struct sockaddr_in));
+	group->sin_family = AF_INET;
+	group->sin_port = htons(atoi(colon + 1));
+	if (inet_aton(arg, &group->sin_addr) == 0 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+		return -1;
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
-	rudp_socket_t rsock;
+	pthread_t thread;
 	int port;
 
 	int c;
+	int i;
 
 	/* 
 	 * Parse and collect arguments
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	while ((c = getopt(argc, argv, "dw:a:l:s:t:m:I:")) != -1) {
 		if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 'w') {
+			window = atoi(optarg);
+		}
+		else if (c == 'a') {
+			ack_every = atoi(optarg);
+		}
+		else if (c == 'l') {
+			loss = atoi(optarg);
+		}
+		else if (c == 's') {
+			mss = atoi(optarg);
+		}
+		else if (c == 't') {
+			threads = atoi(optarg);
+			if (threads < 1)
+				usage();
+		}
+		else if (c == 'm') {
+			if (parse_group(optarg, &group) < 0)
+				usage();
+		}
+		else if (c == 'I') {
+			if (inet_aton(optarg, &ifaddr) == 0)
+				usage();
+			ifaddrp = &ifaddr;
+		}
 		else 
 			usage();
 	}
@@ -87,18 +151,65 @@ int main(int argc, char* argv[]) {
 	}
 
 	if (debug) {
+		rudp_log_level(RUDP_LOG_TRACE, RUDP_LOG_ALL);
 		printf("RUDP receiver waiting on port %i.\n",port);
 	}
 
+	/*
+	 * The kernel spreads the senders among the threads
+	 */
+
+	for (i = 1; i < threads; i++) {
+		if (pthread_create(&thread, NULL, receiver, (void *)(intptr_t)port) != 0) {
+			fprintf(stderr,"vs_recv: pthread_create() failed\n");
+			exit(1);
+		}
+	}
+	receiver((void *)(intptr_t)port);
+
+	return (0);
+}
+
+/*
+ * receiver: Receive files on port, with a socket and event loop of
+ * this thread
+ */
+
+void *receiver(void *arg) {
+	rudp_socket_t rsock;
+	int port = (intptr_t)arg;
+
 	/*
 	 * Create RUDP listener socket
 	 */
 
-	if ((rsock = rudp_socket(port)) == NULL) {
+	if (threads > 1)
+		rsock = rudp_socket_reuseport(port);
+	else
+		rsock = rudp_socket(port);
+	if (rsock == NULL) {
 		fprintf(stderr,"vs_recv: rudp_socket() failed\n");
 		exit(1);
 	}
 
+	if (window > 0 && rudp_setsockopt(rsock, RUDP_OPT_WINDOW, window) < 0) {
+		exit(1);
+	}
+	if (ack_every > 0 && rudp_setsockopt(rsock, RUDP_OPT_ACK_EVERY, ack_every) < 0) {
+		exit(1);
+	}
+	if (loss > 0 && rudp_setsockopt(rsock, RUDP_OPT_LOSS, loss) < 0) {
+		exit(1);
+	}
+	if (mss > 0 && rudp_setsockopt(rsock, RUDP_OPT_MSS, mss) < 0) {
+		exit(1);
+	}
+	if (group.sin_family != 0 && rudp_join_group(rsock, &group, ifaddrp) < 0) {
+		if (ifaddrp == NULL)
+			fprintf(stderr, "vs_recv: Give the address of an interface with -I\n");
+		exit(1);
+	}
+
 	/*
 	 * Register receiver callback function
 	 */
@@ -117,7 +228,7 @@ int main(int argc, char* argv[]) {
 
 	eventloop(0);
 
-	return (0);
+	return NULL;
 }
 
 /*
@@ -138,6 +249,7 @@ static struct rxfile *rxfind(struct sockaddr_in *addr) {
 		exit(1);
 	}
 	rx->fileopen = 0;
+	rx->buf = NULL;
 	rx->remote = *addr;
 	rx->next = rxhead;
 	rxhead = rx;
@@ -158,10 +270,53 @@ static int rxdel(struct rxfile *rx) {
 		return -1;
 	}
 	*rxp = rx->next;
+	free(rx->buf);
 	free(rx);
 	return 0;
 }
 
+/*
+ * rxwrite: helper function to write data at offset in a file. Data that
+ * follows the data before it is collected in the write-behind buffer, and
+ * written with one pwrite when the buffer is full or data arrives for
+ * another part of the file
+ */
+
+static int rxwrite(struct rxfile *rx, off_t offset, void *data, int len) {
+	if (rx->buflen > 0 && (offset != rx->bufoff + rx->buflen ||
+			       rx->buflen + len > VS_WRITEBEHIND)) {
+		if (rxflush(rx) < 0)
+			return -1;
+	}
+	if (rx->buflen == 0)
+		rx->bufoff = offset;
+	memcpy(rx->buf + rx->buflen, data, len);
+	rx->buflen += len;
+	return 0;
+}
+
+/*
+ * rxflush: helper function to write out the write-behind buffer of a file
+ */
+
+static int rxflush(struct rxfile *rx) {
+	int n, done = 0;
+
+	while (done < rx->buflen) {
+		n = pwrite(rx->fd, rx->buf + done, rx->buflen - done, rx->bufoff + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("vs_recv: pwrite");
+			rx->buflen = 0;
+			return -1;
+		}
+		done += n;
+	}
+	rx->buflen = 0;
+	return 0;
+}
+
 
 /* 
  * eventhandler: callback function for RUDP events
@@ -178,6 +333,7 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 				ntohs(remote->sin_port));
 			if ((rx = rxfind(remote))) {
 				if (rx->fileopen) {
+					rxflush(rx);
 					close(rx->fd);
 				}
 				rxdel(rx);
@@ -193,6 +349,7 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 				fprintf(stderr, "vs_recv: prematurely closed communication with %s:%d\n",
 					inet_ntoa(remote->sin_addr),
 					ntohs(remote->sin_port));
+				rxflush(rx);
 				close(rx->fd);
 			}
 			rxdel(rx);
@@ -214,6 +371,7 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 	struct rxfile *rx;
 	int namelen;
 	int i;
+	off_t size, offset;
 
 	struct vsftp *vs = (struct vsftp *) buf;
 	if (len < VS_MINLEN) {
@@ -224,10 +382,15 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 	rx = rxfind(remote);
 	switch (ntohl(vs->vs_type)) {
 	case VS_TYPE_BEGIN:
-		namelen = len - sizeof(vs->vs_type);
+		if (len < VS_BEGINLEN) {
+			fprintf(stderr, "vs_recv: Too short BEGIN (%d bytes)\n", len);
+			return 0;
+		}
+		size = ((off_t)ntohl(vs->vs_info.vs_begin.vs_size[0]) << 32) | ntohl(vs->vs_info.vs_begin.vs_size[1]);
+		namelen = len - VS_BEGINLEN;
 		if (namelen > VS_FILENAMELENGTH)
 			namelen = VS_FILENAMELENGTH;
-		strncpy(rx->name, vs->vs_info.vs_filename, namelen);
+		strncpy(rx->name, vs->vs_info.vs_begin.vs_filename, namelen);
 		rx->name[namelen] = '\0'; /* Null terminated */
 
 		/* Verify that file name is valid
@@ -251,8 +414,16 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 			perror("vs_recv: create");
 			rudp_close(rsocket);
 		}
+		else if (rx->buf == NULL && (rx->buf = malloc(VS_WRITEBEHIND)) == NULL) {
+			fprintf(stderr, "vs_receiver: malloc failed\n");
+			exit(1);
+		}
 		else {
 			rx->fileopen = 1;
+			rx->buflen = 0;
+			/* Allocate the file at once, so that it is not fragmented */
+			if (size > 0 && posix_fallocate(rx->fd, 0, size) != 0 && debug)
+				fprintf(stderr, "vs_recv: could not preallocate \"%s\"\n", rx->name);
 		}
 		break;
 	case VS_TYPE_DATA:
@@ -261,12 +432,15 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 				len, 
 				inet_ntoa(remote->sin_addr), ntohs(remote->sin_port));
 		}
-		len -= sizeof(vs->vs_type);
-		/* len now is length of payload (data or file name) */
+		if (len < VS_DATALEN) {
+			fprintf(stderr, "vs_recv: Too short DATA (%d bytes)\n", len);
+			return 0;
+		}
+		offset = ((off_t)ntohl(vs->vs_info.vs_block.vs_offset[0]) << 32) | ntohl(vs->vs_info.vs_block.vs_offset[1]);
+		len -= VS_DATALEN;
+		/* len now is length of data */
 		if (rx->fileopen) {
-			if ((write(rx->fd, vs->vs_info.vs_filename, len)) < 0) {
-				perror("vs_recv: write");
-			}
+			rxwrite(rx, offset, vs->vs_info.vs_block.vs_data, len);
 		}
 		else {
 			fprintf(stderr, "vs_recv: DATA ignored (file not open)\n");
@@ -279,6 +453,7 @@ int rudp_receiver(rudp_socket_t rsocket, struct sockaddr_in *remote, char *buf,
 		}
 		printf("vs_recv: received end of file \"%s\"\n", rx->name);
 		if (rx->fileopen) {
+			rxflush(rx);
 			close(rx->fd);
 			rxdel(rx);
 		}
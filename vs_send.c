@@ -11,8 +11,11 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -22,12 +25,35 @@
 
 #define MAXPEERS 32			/* Max number of remote peers */
 #define MAXPEERNAMELEN 256		/* Max length of peer name */
+#define VS_BLOCK 64			/* Records read from a file at once */
+
+/*
+ * A file being sent. It is read a block of VS_BLOCK full records at a
+ * time, with one readv into the records, and each record is sent to all
+ * peers at once. When a peer's send buffer is full, the file is not read
+ * until RUDP_EVENT_WRITABLE, and the rest of the block is sent then.
+ */
+struct txfile {
+	rudp_socket_t rsock;
+	int fd;
+	struct vsftp vs[VS_BLOCK];	/* Records of the block */
+	int vslen[VS_BLOCK];
+	int nrecs;		/* Records in the block */
+	int rec;		/* Next record to send */
+	off_t offset;		/* Bytes of the file read */
+	int blocked;		/* Waiting for RUDP_EVENT_WRITABLE? */
+	struct txfile *next;
+};
+
 /* 
  * Prototypes 
  */
 
 int usage();
+int parse_group(char *arg, struct sockaddr_in *group);
 int filesender(int fd, void *arg);
+int readblock(struct txfile *tx);
+int txsend(struct txfile *tx);
 void send_file(char *filename);
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote);
 
@@ -36,18 +62,44 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
  */
 
 int debug = 0;			/* Debug flag */
+int window = 0;			/* RUDP window size, 0 for default */
+int cc = -1;			/* Congestion control algorithm, -1 for default */
+int loss = 0;			/* Percentage of packets dropped, for testing */
+struct sockaddr_in group;		/* Multicast group, sin_family 0 if none */
+struct in_addr ifaddr;			/* Interface to send to it from */
+struct in_addr *ifaddrp = NULL;		/* &ifaddr if one was given */
 struct sockaddr_in peers[MAXPEERS];	/* IP address and port */
 int npeers = 0;			/* Number of elements in peers */
+struct txfile *txhead = NULL;	/* Files being sent */
 
 /* 
  * usage: how to use program
  */
 
 int usage() {
-	fprintf(stderr, "Usage: vs_send [-d] host1:port1 [host2:port2] ... file1 [file2]... \n");
+	fprintf(stderr, "Usage: vs_send [-d] [-w window] [-c none|reno|bbr] [-l loss] [-m group:port [-I ifaddr]] host1:port1 [host2:port2] ... file1 [file2]... \n");
+	fprintf(stderr, "  -I gives the interface of the group, e.g. 127.0.0.1 on one host; it is needed if there is no route for the group\n");
 	exit(1);
 }
 
+/*
+ * parse_group: Parse a multicast group given as address:port
+ */
+
+int parse_group(char *arg, struct sockaddr_in *group) {
+	char *colon = strchr(arg, ':');
+
+	if (colon == NULL || atoi(colon + 1) <= 0)
+		return -1;
+	*colon = '\0';
+	memset(group, 0, sizeof(struct sockaddr_in));
+	group->sin_family = AF_INET;
+	group->sin_port = htons(atoi(colon + 1));
+	if (inet_aton(arg, &group->sin_addr) == 0 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+		return -1;
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
 	int port;
 	char *hoststr;
@@ -61,13 +113,41 @@ int main(int argc, char* argv[]) {
 	 */
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "d")) != -1) {
+	while ((c = getopt(argc, argv, "dw:c:l:m:I:")) != -1) {
 		if (c == 'd') {
 			debug = 1;
 		}
+		else if (c == 'w') {
+			window = atoi(optarg);
+		}
+		else if (c == 'c') {
+			if (strcmp(optarg, "none") == 0)
+				cc = RUDP_CC_NONE;
+			else if (strcmp(optarg, "reno") == 0)
+				cc = RUDP_CC_RENO;
+			else if (strcmp(optarg, "bbr") == 0)
+				cc = RUDP_CC_BBR;
+			else
+				usage();
+		}
+		else if (c == 'l') {
+			loss = atoi(optarg);
+		}
+		else if (c == 'm') {
+			if (parse_group(optarg, &group) < 0)
+				usage();
+		}
+		else if (c == 'I') {
+			if (inet_aton(optarg, &ifaddr) == 0)
+				usage();
+			ifaddrp = &ifaddr;
+		}
 		else 
 			usage();
 	}
+	if (debug) {
+		rudp_log_level(RUDP_LOG_TRACE, RUDP_LOG_ALL);
+	}
 
 	for (i = optind; i < argc; i++) {
 		/* found last host:port? */
@@ -121,6 +201,7 @@ int main(int argc, char* argv[]) {
  */
 
 int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *remote) {
+	struct txfile *tx;
 	
 	switch (event) {
 	case RUDP_EVENT_TIMEOUT:
@@ -139,6 +220,12 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 			fprintf(stderr, "rudp_sender: socket closed\n");
 		}
 		break;
+	case RUDP_EVENT_WRITABLE:
+		for (tx = txhead; tx != NULL; tx = tx->next) {
+			if (tx->rsock == rsocket && tx->blocked)
+				txsend(tx);
+		}
+		break;
 	}
 	return 0;
 }
@@ -152,25 +239,50 @@ int eventhandler(rudp_socket_t rsocket, rudp_event_t event, struct sockaddr_in *
 
 void send_file(char *filename) {
 	struct vsftp vs;
+	struct stat st;
 	int vslen;
 	char *filename1;
 	int namelen;
 	int file = 0;
 	int p;
 	rudp_socket_t rsock;
+	struct txfile *tx;
 
 	if ((file = open(filename, O_RDONLY)) < 0) {
 		perror("vs_sender: open");
 		exit(-1);
 	}
+	/* Read ahead further, it is read once from start to end */
+	posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (fstat(file, &st) < 0) {
+		perror("vs_sender: fstat");
+		exit(-1);
+	}
 	rsock = rudp_socket(0);
 	if (rsock == NULL) {
 		fprintf(stderr, "vs_send: rudp_socket() failed\n");
 		exit(1);
 	}
 	rudp_event_handler(rsock, eventhandler);
+	if (window > 0 && rudp_setsockopt(rsock, RUDP_OPT_WINDOW, window) < 0) {
+		exit(1);
+	}
+	if (cc >= 0 && rudp_setsockopt(rsock, RUDP_OPT_CC, cc) < 0) {
+		exit(1);
+	}
+	if (loss > 0 && rudp_setsockopt(rsock, RUDP_OPT_LOSS, loss) < 0) {
+		exit(1);
+	}
+	/* The records go to the group once, the peers are its members */
+	if (group.sin_family != 0 && rudp_multicast(rsock, &group, ifaddrp) < 0) {
+		if (ifaddrp == NULL)
+			fprintf(stderr, "vs_send: Give the address of an interface with -I\n");
+		exit(1);
+	}
 
 	vs.vs_type = htonl(VS_TYPE_BEGIN);
+	vs.vs_info.vs_begin.vs_size[0] = htonl((u_int64_t)st.st_size >> 32);
+	vs.vs_info.vs_begin.vs_size[1] = htonl((u_int64_t)st.st_size & 0xffffffff);
 
 	/* strip of any leading path name */
 	filename1 = filename;
@@ -179,78 +291,142 @@ void send_file(char *filename) {
 	
 	/* Copy file name into VS data */
 	namelen = strlen(filename1) < VS_FILENAMELENGTH  ? strlen(filename1) : VS_FILENAMELENGTH;
-	strncpy(vs.vs_info.vs_filename, filename1, namelen);
+	strncpy(vs.vs_info.vs_begin.vs_filename, filename1, namelen);
 
-	vslen = sizeof(vs.vs_type) + namelen;
-	for (p = 0; p < npeers; p++) {
-		if (debug) {
+	vslen = VS_BEGINLEN + namelen;
+	if (debug) {
+		for (p = 0; p < npeers; p++) {
 			fprintf(stderr, "vs_send: send BEGIN \"%s\" (%d bytes) to %s:%d\n",
 				filename, vslen, 
 				inet_ntoa(peers[p].sin_addr), ntohs(peers[p].sin_port));
 		}
-		if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-			fprintf(stderr,"rudp_sender: send failure\n");
-			rudp_close(rsock);		
-			return;
-		}
 	}
-	event_fd(file, filesender, rsock, "filesender");
+	if (rudp_sendto_group(rsock, (char *) &vs, vslen, peers, npeers) < 0) {
+		fprintf(stderr,"rudp_sender: send failure\n");
+		rudp_close(rsock);		
+		return;
+	}
+	if ((tx = malloc(sizeof(struct txfile))) == NULL) {
+		fprintf(stderr, "vs_send: malloc failed\n");
+		exit(1);
+	}
+	tx->rsock = rsock;
+	tx->fd = file;
+	tx->nrecs = 0;
+	tx->rec = 0;
+	tx->offset = 0;
+	tx->blocked = 0;
+	tx->next = txhead;
+	txhead = tx;
+	event_fd(file, filesender, tx, "filesender");
 }
 
 /*
  * filesender: callback function for handling sending of the file.
  * Will be called when data is available on the file (which is always
- * true, until the file is closed...). 
- * Send file data. Detect end of file and tell VS peers that transfer is
- * complete
+ * true, until the file is closed...), as long as the peers have room
+ * for more. Reads a block of the file and sends it. Detect end of file
+ * and tell VS peers that transfer is complete
  */
 
 int filesender(int file, void *arg) {
-    rudp_socket_t rsock = 	(rudp_socket_t) arg;
-    int bytes;
-    struct vsftp vs;
-    int vslen;
-    int p;
+    struct txfile *tx = (struct txfile *) arg;
 
-    bytes = read(file, &vs.vs_info.vs_data,VS_MAXDATA);
-    if (bytes < 0) {
+    if (readblock(tx) < 0) {
 	perror("filesender: read");
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
+	event_fd_delete(filesender, tx);
+	rudp_close(tx->rsock);		
+	return 0;
     }
-    else if (bytes == 0) {
-	vs.vs_type = htonl(VS_TYPE_END);
-	vslen = sizeof(vs.vs_type);
-	for (p = 0; p < npeers; p++) {
-	    if (debug) {
-		fprintf(stderr, "vs_send: send END (%d bytes) to %s:%d\n", 
-			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
-	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-		fprintf(stderr,"rudp_sender: send failure\n");
-		break;
-	    }
-	}
-	event_fd_delete(filesender, rsock);
-	rudp_close(rsock);		
+    return txsend(tx);
+}
+
+/*
+ * readblock: Read the next block of a file into its records, with one
+ * system call. At end of file, the block is the END record. The pages
+ * that have been read are dropped from the cache, so that sending a
+ * large file does not fill it.
+ */
+
+int readblock(struct txfile *tx) {
+    struct iovec iov[VS_BLOCK];
+    int bytes, len, i;
+
+    for (i = 0; i < VS_BLOCK; i++) {
+	iov[i].iov_base = tx->vs[i].vs_info.vs_block.vs_data;
+	iov[i].iov_len = VS_MAXDATA;
+    }
+    bytes = readv(tx->fd, iov, VS_BLOCK);
+    if (bytes < 0)
+	return -1;
+    posix_fadvise(tx->fd, tx->offset, bytes, POSIX_FADV_DONTNEED);
+
+    tx->rec = 0;
+    if (bytes == 0) {
+	tx->vs[0].vs_type = htonl(VS_TYPE_END);
+	tx->vslen[0] = sizeof(tx->vs[0].vs_type);
+	tx->nrecs = 1;
+	return 0;
     }
-    else {
-	vs.vs_type = htonl(VS_TYPE_DATA);
-	vslen = sizeof(vs.vs_type) + bytes;
-	for (p = 0; p < npeers; p++) {
-	    if (debug) {
-		fprintf(stderr, "vs_send: send DATA (%d bytes) to %s:%d\n", 
-			vslen, inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));				
+    for (i = 0; bytes > 0; i++) {
+	len = bytes < VS_MAXDATA ? bytes : VS_MAXDATA;
+	tx->vs[i].vs_type = htonl(VS_TYPE_DATA);
+	tx->vs[i].vs_info.vs_block.vs_offset[0] = htonl((u_int64_t)tx->offset >> 32);
+	tx->vs[i].vs_info.vs_block.vs_offset[1] = htonl((u_int64_t)tx->offset & 0xffffffff);
+	tx->vslen[i] = VS_DATALEN + len;
+	tx->offset += len;
+	bytes -= len;
+    }
+    tx->nrecs = i;
+    return 0;
+}
+
+/*
+ * txsend: Send the rest of the block of a file to all peers, sharing one
+ * copy of each record. If a peer's send buffer is full, stop reading the
+ * file until it has room, and read on once the block has been sent.
+ * Close the socket after the END record.
+ */
+
+int txsend(struct txfile *tx) {
+    struct vsftp *vs;
+    int end;
+    int p;
+
+    for (; tx->rec < tx->nrecs; tx->rec++) {
+	vs = &tx->vs[tx->rec];
+	end = vs->vs_type == htonl(VS_TYPE_END);
+	if (rudp_sendto_group(tx->rsock, (char *) vs, tx->vslen[tx->rec], peers, npeers) < 0) {
+	    if (errno == EAGAIN) {
+		if (!tx->blocked)
+		    event_fd_delete(filesender, tx);
+		tx->blocked = 1;
+		return 0;
 	    }
-	    if (rudp_sendto(rsock, (char *) &vs, vslen, &peers[p]) < 0) {
-		fprintf(stderr,"rudp_sender: send failure\n");
-		event_fd_delete(filesender, rsock);
-		rudp_close(rsock);		
-		break;
+	    fprintf(stderr,"rudp_sender: send failure\n");
+	    if (!tx->blocked)
+		event_fd_delete(filesender, tx);
+	    tx->blocked = 0;
+	    rudp_close(tx->rsock);		
+	    return 0;
+	}
+	if (debug) {
+	    for (p = 0; p < npeers; p++) {
+		fprintf(stderr, "vs_send: send %s (%d bytes) to %s:%d\n", end ? "END" : "DATA",
+			tx->vslen[tx->rec], inet_ntoa(peers[p].sin_addr), htons(peers[p].sin_port));
 	    }
 	}
+	if (end) {
+	    if (!tx->blocked)
+		event_fd_delete(filesender, tx);
+	    tx->blocked = 0;
+	    rudp_close(tx->rsock);		
+	    return 0;
+	}
+    }
+    if (tx->blocked) {
+	tx->blocked = 0;
+	event_fd(tx->fd, filesender, tx, "filesender");
     }
     return 0;
 }
-
-
@@ -1,15 +1,30 @@
 #define VS_MINLEN	4
 #define VS_FILENAMELENGTH 128
-#define VS_MAXDATA	128
+#define VS_MAXDATA	988	/* A record with its offset fills a packet of RUDP_MAXPKTSIZE */
 
 #define VS_TYPE_BEGIN	1
 #define VS_TYPE_DATA	2
 #define VS_TYPE_END 	3
 
+/*
+ * BEGIN carries the size of the file and its name, DATA the offset of its
+ * data in the file, so that it can be written wherever it is. 64-bit
+ * numbers are sent as two words in network byte order, high word first.
+ */
+
 struct vsftp {
 	u_int32_t vs_type;
 	union {
-		char vs_filename[VS_FILENAMELENGTH];
-		u_int8_t vs_data[VS_MAXDATA];
+		struct {
+			u_int32_t vs_size[2];
+			char vs_filename[VS_FILENAMELENGTH];
+		} vs_begin;
+		struct {
+			u_int32_t vs_offset[2];
+			u_int8_t vs_data[VS_MAXDATA];
+		} vs_block;
 	} vs_info;
 };
+
+#define VS_BEGINLEN	(sizeof(u_int32_t) * 3)	/* BEGIN without the name */
+#define VS_DATALEN	(sizeof(u_int32_t) * 3)	/* DATA without the data */